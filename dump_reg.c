@@ -2,8 +2,13 @@
 #include "bcm2835.h"
 #include <stdio.h>
 #include <stdlib.h>
-// #include <unistd.h>
+#include <unistd.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define BCM2835_PHY_BASE  0x7E000000
 #define BCM2835_MU_BASE     0x215040
@@ -19,14 +24,6 @@
 #define MODULE_BASE(title) \
     bcm2835_get_page(title, 1); \
 
-#define REG_TITLE(title) \
-    bcm2835_get_page(title, 0); \
-    printf("%-25s %-4s %-10s\n", "Register Name", "Ofst", "Value");
-#define GET_REG(offset) \
-    printf("%-25s 0x%02x 0x%08x\n", #offset, offset, *(uint32_t*)(bcm2835_reg_base(#offset)+offset));
-#define GET_REG_ADDR(base, offset) \
-    printf("%-25s 0x%02x 0x%08x\n", #offset, offset, *(uint32_t*)((uint32_t)base+offset));
-
 typedef struct {
     char *   prefix;
     uint32_t offset;
@@ -34,6 +31,28 @@ typedef struct {
     uint32_t page;
 } reg_info_st;
 
+// reg_info[] entries
+typedef enum
+{
+    BLK_AUX_MU = 0,
+    BLK_AUX_SPI,
+    BLK_AUX,
+    BLK_BSC0,
+    BLK_BSC1,
+    BLK_BSC2,
+    BLK_BSC,
+    BLK_DMA,
+    BLK_EMMC,
+    BLK_GP,
+    BLK_PWMCLK,
+    BLK_IRQ,
+    BLK_PCM,
+    BLK_PWM,
+    BLK_PADS_GPIO,
+    BLK_SPI0,
+    BLK_ST,
+} block_st;
+
 // see also https://www.raspberrypi.org/app/uploads/2012/02/BCM2835-ARM-Peripherals.pdf
 reg_info_st reg_info[] = {
     { "BCM2835_AUX_MU",     BCM2835_MU_BASE   , "2.2.2", 11 },
@@ -78,21 +97,6 @@ uint32_t bcm2835_get_page(char *title, int addr)
     return reg_info[i].page;
 }
 
-uint32_t bcm2835_reg_base(char *reg_name)
-{
-    int i;
-    uint32_t reg_base = 0;
-
-    for(i=0; i<sizeof(reg_info)/sizeof(reg_info[0]); i++) {
-        if (strncmp(reg_info[i].prefix, reg_name, strlen(reg_info[i].prefix)) == 0) {
-            reg_base = (uint32_t)bcm2835_peripherals + reg_info[i].offset;
-            break;
-        }
-    }
-
-    return reg_base;
-}
-
 void bcm2835_dump_reg_base()
 {
     // printf("euid: %d\n", geteuid());
@@ -134,83 +138,6 @@ void bcm2835_dump_reg_base()
     return;
 }
 
-void bcm2835_dump_reg_spi()
-{
-    REG_TITLE("SPI0");
-    GET_REG(BCM2835_SPI0_CS  );
-    GET_REG(BCM2835_SPI0_FIFO);
-    GET_REG(BCM2835_SPI0_CLK );
-    GET_REG(BCM2835_SPI0_DLEN);
-    GET_REG(BCM2835_SPI0_LTOH);
-    GET_REG(BCM2835_SPI0_DC  );
-    REG_TITLE("AUX");
-    GET_REG(BCM2835_AUX_IRQ       );
-    GET_REG(BCM2835_AUX_ENABLE    );
-    REG_TITLE("AUX_SPI");
-    GET_REG(BCM2835_AUX_SPI_CNTL0 );
-    GET_REG(BCM2835_AUX_SPI_CNTL1 );
-    GET_REG(BCM2835_AUX_SPI_STAT  );
-    GET_REG(BCM2835_AUX_SPI_PEEK  );
-    GET_REG(BCM2835_AUX_SPI_IO    );
-    GET_REG(BCM2835_AUX_SPI_TXHOLD);
-}
-
-void bcm2835_dump_reg_bsc()
-{
-    REG_TITLE("BSC0");
-    GET_REG_ADDR(bcm2835_bsc0, BCM2835_BSC_C   );
-    GET_REG_ADDR(bcm2835_bsc0, BCM2835_BSC_S   );
-    GET_REG_ADDR(bcm2835_bsc0, BCM2835_BSC_DLEN);
-    GET_REG_ADDR(bcm2835_bsc0, BCM2835_BSC_A   );
-    GET_REG_ADDR(bcm2835_bsc0, BCM2835_BSC_FIFO);
-    GET_REG_ADDR(bcm2835_bsc0, BCM2835_BSC_DIV );
-    GET_REG_ADDR(bcm2835_bsc0, BCM2835_BSC_DEL );
-    GET_REG_ADDR(bcm2835_bsc0, BCM2835_BSC_CLKT);
-    REG_TITLE("BSC1");
-    GET_REG_ADDR(bcm2835_bsc1, BCM2835_BSC_C   );
-    GET_REG_ADDR(bcm2835_bsc1, BCM2835_BSC_S   );
-    GET_REG_ADDR(bcm2835_bsc1, BCM2835_BSC_DLEN);
-    GET_REG_ADDR(bcm2835_bsc1, BCM2835_BSC_A   );
-    GET_REG_ADDR(bcm2835_bsc1, BCM2835_BSC_FIFO);
-    GET_REG_ADDR(bcm2835_bsc1, BCM2835_BSC_DIV );
-    GET_REG_ADDR(bcm2835_bsc1, BCM2835_BSC_DEL );
-    GET_REG_ADDR(bcm2835_bsc1, BCM2835_BSC_CLKT);
-}
-
-void bcm2835_dump_reg_gpio()
-{
-    REG_TITLE("GP");
-    GET_REG(BCM2835_GPFSEL0  );
-    GET_REG(BCM2835_GPFSEL1  );
-    GET_REG(BCM2835_GPFSEL2  );
-    GET_REG(BCM2835_GPFSEL3  );
-    GET_REG(BCM2835_GPFSEL4  );
-    GET_REG(BCM2835_GPFSEL5  );
-    GET_REG(BCM2835_GPSET0   );
-    GET_REG(BCM2835_GPSET1   );
-    GET_REG(BCM2835_GPCLR0   );
-    GET_REG(BCM2835_GPCLR1   );
-    GET_REG(BCM2835_GPLEV0   );
-    GET_REG(BCM2835_GPLEV1   );
-    GET_REG(BCM2835_GPEDS0   );
-    GET_REG(BCM2835_GPEDS1   );
-    GET_REG(BCM2835_GPREN0   );
-    GET_REG(BCM2835_GPREN1   );
-    GET_REG(BCM2835_GPFEN0   );
-    GET_REG(BCM2835_GPFEN1   );
-    GET_REG(BCM2835_GPHEN0   );
-    GET_REG(BCM2835_GPHEN1   );
-    GET_REG(BCM2835_GPLEN0   );
-    GET_REG(BCM2835_GPLEN1   );
-    GET_REG(BCM2835_GPAREN0  );
-    GET_REG(BCM2835_GPAREN1  );
-    GET_REG(BCM2835_GPAFEN0  );
-    GET_REG(BCM2835_GPAFEN1  );
-    GET_REG(BCM2835_GPPUD    );
-    GET_REG(BCM2835_GPPUDCLK0);
-    GET_REG(BCM2835_GPPUDCLK1);
-}
-
 #undef BCM2835_PWM_CONTROL
 #undef BCM2835_PWM_STATUS 
 #undef BCM2835_PWM_DMAC   
@@ -229,36 +156,11 @@ void bcm2835_dump_reg_gpio()
 #define BCM2835_PWM1_RANGE  0x20
 #define BCM2835_PWM1_DATA   0x24
 
-void bcm2835_dump_reg_pwm()
-{
-    REG_TITLE("PWM");
-    GET_REG(BCM2835_PWM_CONTROL);
-    GET_REG(BCM2835_PWM_STATUS );
-    GET_REG(BCM2835_PWM_DMAC   );
-    GET_REG(BCM2835_PWM0_RANGE );
-    GET_REG(BCM2835_PWM0_DATA  );
-    GET_REG(BCM2835_PWM_FIF1   );
-    GET_REG(BCM2835_PWM1_RANGE );
-    GET_REG(BCM2835_PWM1_DATA  );
-}
-
 #define BCM2835_ST_C0 0x0c
 #define BCM2835_ST_C1 0x10
 #define BCM2835_ST_C2 0x14
 #define BCM2835_ST_C3 0x18
 
-void bcm2835_dump_reg_st()
-{
-    REG_TITLE("ST");
-    GET_REG(BCM2835_ST_CS );
-    GET_REG(BCM2835_ST_CLO);
-    GET_REG(BCM2835_ST_CHI);
-    GET_REG(BCM2835_ST_C0 );
-    GET_REG(BCM2835_ST_C1 );
-    GET_REG(BCM2835_ST_C2 );
-    GET_REG(BCM2835_ST_C3 );
-}
-
 typedef enum
 {
     REG_BASE = 0,
@@ -278,52 +180,1463 @@ char *reg_module[] = {
     "st",
 };
 
+typedef struct {
+    char *   name;
+    uint8_t  module;    // module_st that dumps it
+    uint8_t  block;     // reg_info[] entry its offset is relative to
+    uint16_t offset;
+    uint32_t flags;
+} reg_def_st;
+
+#define REG_F_POP 0x01  // a read takes a word out of a FIFO
+
+#define REG(module, block, offset) \
+    { #offset, module, block, offset, 0 }
+#define REG_FIFO(module, block, offset) \
+    { #offset, module, block, offset, REG_F_POP }
+
+// every register dump_reg knows, in dump order; a snapshot holds one value
+// per entry, so only ever append to this table
+reg_def_st reg_def[] = {
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPFSEL0       ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPFSEL1       ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPFSEL2       ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPFSEL3       ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPFSEL4       ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPFSEL5       ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPSET0        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPSET1        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPCLR0        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPCLR1        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPLEV0        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPLEV1        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPEDS0        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPEDS1        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPREN0        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPREN1        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPFEN0        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPFEN1        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPHEN0        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPHEN1        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPLEN0        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPLEN1        ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPAREN0       ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPAREN1       ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPAFEN0       ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPAFEN1       ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPPUD         ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPPUDCLK0     ),
+    REG(REG_GPIO, BLK_GP     , BCM2835_GPPUDCLK1     ),
+    REG(REG_PWM , BLK_PWM    , BCM2835_PWM_CONTROL   ),
+    REG(REG_PWM , BLK_PWM    , BCM2835_PWM_STATUS    ),
+    REG(REG_PWM , BLK_PWM    , BCM2835_PWM_DMAC      ),
+    REG(REG_PWM , BLK_PWM    , BCM2835_PWM0_RANGE    ),
+    REG(REG_PWM , BLK_PWM    , BCM2835_PWM0_DATA     ),
+    REG(REG_PWM , BLK_PWM    , BCM2835_PWM_FIF1      ),
+    REG(REG_PWM , BLK_PWM    , BCM2835_PWM1_RANGE    ),
+    REG(REG_PWM , BLK_PWM    , BCM2835_PWM1_DATA     ),
+    REG(REG_BSC , BLK_BSC0   , BCM2835_BSC_C         ),
+    REG(REG_BSC , BLK_BSC0   , BCM2835_BSC_S         ),
+    REG(REG_BSC , BLK_BSC0   , BCM2835_BSC_DLEN      ),
+    REG(REG_BSC , BLK_BSC0   , BCM2835_BSC_A         ),
+    REG_FIFO(REG_BSC , BLK_BSC0   , BCM2835_BSC_FIFO      ),
+    REG(REG_BSC , BLK_BSC0   , BCM2835_BSC_DIV       ),
+    REG(REG_BSC , BLK_BSC0   , BCM2835_BSC_DEL       ),
+    REG(REG_BSC , BLK_BSC0   , BCM2835_BSC_CLKT      ),
+    REG(REG_BSC , BLK_BSC1   , BCM2835_BSC_C         ),
+    REG(REG_BSC , BLK_BSC1   , BCM2835_BSC_S         ),
+    REG(REG_BSC , BLK_BSC1   , BCM2835_BSC_DLEN      ),
+    REG(REG_BSC , BLK_BSC1   , BCM2835_BSC_A         ),
+    REG_FIFO(REG_BSC , BLK_BSC1   , BCM2835_BSC_FIFO      ),
+    REG(REG_BSC , BLK_BSC1   , BCM2835_BSC_DIV       ),
+    REG(REG_BSC , BLK_BSC1   , BCM2835_BSC_DEL       ),
+    REG(REG_BSC , BLK_BSC1   , BCM2835_BSC_CLKT      ),
+    REG(REG_SPI , BLK_SPI0   , BCM2835_SPI0_CS       ),
+    REG_FIFO(REG_SPI , BLK_SPI0   , BCM2835_SPI0_FIFO     ),
+    REG(REG_SPI , BLK_SPI0   , BCM2835_SPI0_CLK      ),
+    REG(REG_SPI , BLK_SPI0   , BCM2835_SPI0_DLEN     ),
+    REG(REG_SPI , BLK_SPI0   , BCM2835_SPI0_LTOH     ),
+    REG(REG_SPI , BLK_SPI0   , BCM2835_SPI0_DC       ),
+    REG(REG_SPI , BLK_AUX    , BCM2835_AUX_IRQ       ),
+    REG(REG_SPI , BLK_AUX    , BCM2835_AUX_ENABLE    ),
+    REG(REG_SPI , BLK_AUX_SPI, BCM2835_AUX_SPI_CNTL0 ),
+    REG(REG_SPI , BLK_AUX_SPI, BCM2835_AUX_SPI_CNTL1 ),
+    REG(REG_SPI , BLK_AUX_SPI, BCM2835_AUX_SPI_STAT  ),
+    REG(REG_SPI , BLK_AUX_SPI, BCM2835_AUX_SPI_PEEK  ),
+    REG_FIFO(REG_SPI , BLK_AUX_SPI, BCM2835_AUX_SPI_IO    ),
+    REG_FIFO(REG_SPI , BLK_AUX_SPI, BCM2835_AUX_SPI_TXHOLD),
+    REG(REG_ST  , BLK_ST     , BCM2835_ST_CS         ),
+    REG(REG_ST  , BLK_ST     , BCM2835_ST_CLO        ),
+    REG(REG_ST  , BLK_ST     , BCM2835_ST_CHI        ),
+    REG(REG_ST  , BLK_ST     , BCM2835_ST_C0         ),
+    REG(REG_ST  , BLK_ST     , BCM2835_ST_C1         ),
+    REG(REG_ST  , BLK_ST     , BCM2835_ST_C2         ),
+    REG(REG_ST  , BLK_ST     , BCM2835_ST_C3         ),
+};
+
+#define REG_COUNT (sizeof(reg_def)/sizeof(reg_def[0]))
+
+// A snapshot file is the header followed by value[nregs], in the byte order
+// of the machine that took it. Registers of modules missing from the mask
+// were not read and are 0, as are those past nregs in an older snapshot.
+// clo_start/clo_end bracket the read pass.
+#define SNAP_MAGIC   "BCMSNAP"
+#define SNAP_VERSION 1
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t nregs;
+    uint32_t modules;   // 1<<module_st of every module read
+    uint32_t chi;       // ST_CHI, then ST_CLO before and after the pass
+    uint32_t clo_start;
+    uint32_t clo_end;
+} snap_hdr_st;
+
+typedef struct {
+    snap_hdr_st hdr;
+    uint32_t    value[REG_COUNT];
+} snapshot_st;
+
+typedef enum
+{
+    FMT_TEXT = 0,
+    FMT_CSV,
+    FMT_JSON,
+} format_st;
+
+char *reg_format[] = {
+    "text",
+    "csv",
+    "json",
+};
+
+// register addresses in the mapped window, resolved once by reg_map()
+volatile uint32_t *reg_addr[REG_COUNT];
+volatile uint32_t *st_clo;
+volatile uint32_t *st_chi;
+
+void reg_map(uint8_t *window)
+{
+    int i;
+
+    for(i=0; i<REG_COUNT; i++) {
+        reg_addr[i] = (volatile uint32_t *)(window +
+            reg_info[reg_def[i].block].offset + reg_def[i].offset);
+    }
+    st_clo = (volatile uint32_t *)(window + BCM2835_ST_BASE + BCM2835_ST_CLO);
+    st_chi = (volatile uint32_t *)(window + BCM2835_ST_BASE + BCM2835_ST_CHI);
+}
+
+// -S: model the registers that change on their own or when read, for a
+// window mapped from a file. ST counts microseconds from the value in the
+// file; reading a FIFO returns its word once, then 0, and updates the
+// block's status as if the FIFO had run empty.
+typedef struct {
+    uint8_t  block;
+    uint16_t fifo;
+    uint16_t status;
+    uint32_t clear;     // status bits once the FIFO is empty
+    uint32_t set;
+} sim_fifo_st;
+
+sim_fifo_st sim_fifo[] = {
+    { BLK_SPI0   , BCM2835_SPI0_FIFO     , BCM2835_SPI0_CS     ,
+      BCM2835_SPI0_CS_RXF | BCM2835_SPI0_CS_RXR | BCM2835_SPI0_CS_RXD, 0 },
+    { BLK_BSC0   , BCM2835_BSC_FIFO      , BCM2835_BSC_S       ,
+      BCM2835_BSC_S_RXF | BCM2835_BSC_S_RXR | BCM2835_BSC_S_RXD, 0 },
+    { BLK_BSC1   , BCM2835_BSC_FIFO      , BCM2835_BSC_S       ,
+      BCM2835_BSC_S_RXF | BCM2835_BSC_S_RXR | BCM2835_BSC_S_RXD, 0 },
+    { BLK_AUX_SPI, BCM2835_AUX_SPI_IO    , BCM2835_AUX_SPI_STAT,
+      0, BCM2835_AUX_SPI_STAT_RX_EMPTY },
+    { BLK_AUX_SPI, BCM2835_AUX_SPI_TXHOLD, BCM2835_AUX_SPI_STAT,
+      0, BCM2835_AUX_SPI_STAT_RX_EMPTY },
+};
+
+#define SIM_FIFOS (sizeof(sim_fifo)/sizeof(sim_fifo[0]))
+
+typedef struct {
+    int      on;
+    uint64_t t0;        // CLOCK_MONOTONIC us when ST read st0
+    uint64_t st0;
+    volatile uint32_t *fifo[SIM_FIFOS];
+    volatile uint32_t *status[SIM_FIFOS];
+} sim_st;
+
+sim_st sim;
+
+#define REG_READ(addr) \
+    (sim.on ? sim_read(addr) : *(addr))
+
+uint64_t mono_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void sim_start(uint8_t *window)
+{
+    int i;
+
+    for(i=0; i<SIM_FIFOS; i++) {
+        sim.fifo[i]   = (volatile uint32_t *)(window + reg_info[sim_fifo[i].block].offset + sim_fifo[i].fifo);
+        sim.status[i] = (volatile uint32_t *)(window + reg_info[sim_fifo[i].block].offset + sim_fifo[i].status);
+    }
+    sim.st0 = (uint64_t)*st_chi << 32 | *st_clo;
+    sim.t0  = mono_us();
+    sim.on  = 1;
+}
+
+uint32_t sim_read(volatile uint32_t *addr)
+{
+    uint64_t st;
+    uint32_t val;
+    int i;
+
+    if(addr == st_clo || addr == st_chi) {
+        st = sim.st0 + mono_us() - sim.t0;
+        return addr == st_clo ? (uint32_t)st : (uint32_t)(st >> 32);
+    }
+    for(i=0; i<SIM_FIFOS; i++) {
+        if(addr != sim.fifo[i])
+            continue;
+        val = *addr;
+        *addr = 0;
+        *sim.status[i] = (*sim.status[i] & ~sim_fifo[i].clear) | sim_fifo[i].set;
+        return val;
+    }
+    return *addr;
+}
+
+void snapshot_read(snapshot_st *snap, uint32_t modules)
+{
+    int i;
+
+    memset(snap, 0, sizeof(*snap));
+    memcpy(snap->hdr.magic, SNAP_MAGIC, sizeof(snap->hdr.magic));
+    snap->hdr.version = SNAP_VERSION;
+    snap->hdr.nregs   = REG_COUNT;
+    snap->hdr.modules = modules;
+
+    // nothing but loads between the two timer reads
+    snap->hdr.chi       = REG_READ(st_chi);
+    snap->hdr.clo_start = REG_READ(st_clo);
+    for(i=0; i<REG_COUNT; i++) {
+        if(modules & 1<<reg_def[i].module)
+            snap->value[i] = REG_READ(reg_addr[i]);
+    }
+    snap->hdr.clo_end   = REG_READ(st_clo);
+}
+
+int snapshot_save(snapshot_st *snap, char *filename)
+{
+    FILE *fp;
+    int ret = 0;
+
+    fp = fopen(filename, "wb");
+    if(fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    if(fwrite(snap, sizeof(*snap), 1, fp) != 1) {
+        perror(filename);
+        ret = -1;
+    }
+    fclose(fp);
+    return ret;
+}
+
+int snapshot_load(snapshot_st *snap, char *filename)
+{
+    FILE *fp;
+    int ret = -1;
+
+    fp = fopen(filename, "rb");
+    if(fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    // an older dump_reg knew fewer registers: those appended since read as 0
+    memset(snap, 0, sizeof(*snap));
+    if(fread(&snap->hdr, sizeof(snap->hdr), 1, fp) != 1) {
+        fprintf(stderr, "%s: short snapshot\n", filename);
+    } else if(memcmp(snap->hdr.magic, SNAP_MAGIC, sizeof(snap->hdr.magic)) != 0) {
+        fprintf(stderr, "%s: not a dump_reg snapshot\n", filename);
+    } else if(snap->hdr.version != SNAP_VERSION || snap->hdr.nregs > REG_COUNT) {
+        fprintf(stderr, "%s: snapshot version %u with %u registers, expected %u with at most %u\n",
+            filename, snap->hdr.version, snap->hdr.nregs, SNAP_VERSION, (uint32_t)REG_COUNT);
+    } else if(fread(snap->value, sizeof(snap->value[0]), snap->hdr.nregs, fp) != snap->hdr.nregs) {
+        fprintf(stderr, "%s: short snapshot\n", filename);
+    } else {
+        ret = 0;
+    }
+    fclose(fp);
+    return ret;
+}
+
+// The peripheral window is the one bcm2835_init() maps from /dev/mem, or
+// with -m a file. A snapshot is laid out by the reg_def[] offsets in an
+// anonymous window; any other file is taken as an image of the window and
+// mapped as it is, so another process writing the file shows through.
+#define WINDOW_SIZE 0x01000000
+
+uint8_t *window_map_file(char *filename)
+{
+    static snapshot_st snap;
+    struct stat st;
+    uint32_t end = BCM2835_ST_BASE + BCM2835_ST_CHI + 4;
+    uint8_t *window;
+    char magic[8];
+    int fd, i;
+
+    fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        perror(filename);
+        return NULL;
+    }
+    if(read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+        memcmp(magic, SNAP_MAGIC, sizeof(magic)) == 0) {
+        close(fd);
+        if(snapshot_load(&snap, filename) < 0)
+            return NULL;
+        window = mmap(NULL, WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(window == MAP_FAILED) {
+            perror("window");
+            return NULL;
+        }
+        reg_map(window);
+        *st_chi = snap.hdr.chi;
+        *st_clo = snap.hdr.clo_start;
+        for(i=0; i<REG_COUNT; i++) {
+            if(snap.hdr.modules & 1<<reg_def[i].module)
+                *reg_addr[i] = snap.value[i];
+        }
+        return window;
+    }
+
+    for(i=0; i<REG_COUNT; i++) {
+        if(reg_info[reg_def[i].block].offset + reg_def[i].offset + 4 > end)
+            end = reg_info[reg_def[i].block].offset + reg_def[i].offset + 4;
+    }
+    if(fstat(fd, &st) < 0 || st.st_size < end) {
+        fprintf(stderr, "%s: not a snapshot or an image of at least 0x%x bytes\n",
+            filename, end);
+        close(fd);
+        return NULL;
+    }
+    // private: the simulator's writes stay in this process
+    window = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(window == MAP_FAILED) {
+        perror(filename);
+        return NULL;
+    }
+    reg_map(window);
+    return window;
+}
+
+uint8_t *window_open(char *map_file, int simulate)
+{
+    uint8_t *window;
+
+    if(map_file) {
+        window = window_map_file(map_file);
+        if(window && simulate)
+            sim_start(window);
+        return window;
+    }
+    // bcm2835_set_debug(1);
+    if(!bcm2835_init())
+        return NULL;
+    window = (uint8_t *)bcm2835_peripherals;
+    reg_map(window);
+    return window;
+}
+
+// the snapshot as a window image for -m, registers not read stay 0
+int snapshot_save_image(snapshot_st *snap, char *filename)
+{
+    uint32_t st[2] = { snap->hdr.clo_start, snap->hdr.chi };
+    int fd, i;
+    int ret = 0;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        perror(filename);
+        return -1;
+    }
+    if(ftruncate(fd, WINDOW_SIZE) < 0 ||
+        pwrite(fd, st, sizeof(st), BCM2835_ST_BASE + BCM2835_ST_CLO) != sizeof(st))
+        ret = -1;
+    for(i=0; i<REG_COUNT && ret == 0; i++) {
+        if(!(snap->hdr.modules & 1<<reg_def[i].module))
+            continue;
+        if(pwrite(fd, &snap->value[i], 4, reg_info[reg_def[i].block].offset + reg_def[i].offset) != 4)
+            ret = -1;
+    }
+    if(ret < 0)
+        perror(filename);
+    close(fd);
+    return ret;
+}
+
+char *block_name(int block)
+{
+    return reg_info[block].prefix + strlen("BCM2835_");
+}
+
+void snapshot_print_text(snapshot_st *snap)
+{
+    int i;
+    int block = -1;
+
+    if(!snap->hdr.modules)
+        return;
+    printf("\nST 0x%08x%08x, read in %u us\n", snap->hdr.chi,
+        snap->hdr.clo_start, snap->hdr.clo_end - snap->hdr.clo_start);
+    for(i=0; i<REG_COUNT; i++) {
+        if(!(snap->hdr.modules & 1<<reg_def[i].module))
+            continue;
+        if(reg_def[i].block != block) {
+            block = reg_def[i].block;
+            printf("\n%-9s %-5s P%d\n", block_name(block),
+                reg_info[block].section, reg_info[block].page);
+            printf("%-25s %-4s %-10s\n", "Register Name", "Ofst", "Value");
+        }
+        printf("%-25s 0x%02x 0x%08x\n", reg_def[i].name, reg_def[i].offset, snap->value[i]);
+    }
+}
+
+void snapshot_print_csv(snapshot_st *snap)
+{
+    int i;
+
+    printf("module,block,register,offset,address,value\n");
+    for(i=0; i<REG_COUNT; i++) {
+        if(!(snap->hdr.modules & 1<<reg_def[i].module))
+            continue;
+        printf("%s,%s,%s,0x%02x,0x%08x,0x%08x\n", reg_module[reg_def[i].module],
+            block_name(reg_def[i].block), reg_def[i].name, reg_def[i].offset,
+            BCM2835_PHY_BASE + reg_info[reg_def[i].block].offset + reg_def[i].offset,
+            snap->value[i]);
+    }
+}
+
+void snapshot_print_json(snapshot_st *snap)
+{
+    int i;
+    int first = 1;
+
+    printf("{\"version\":%u,\"st_chi\":%u,\"st_clo_start\":%u,\"st_clo_end\":%u,\"registers\":[",
+        snap->hdr.version, snap->hdr.chi, snap->hdr.clo_start, snap->hdr.clo_end);
+    for(i=0; i<REG_COUNT; i++) {
+        if(!(snap->hdr.modules & 1<<reg_def[i].module))
+            continue;
+        printf("%s\n{\"module\":\"%s\",\"block\":\"%s\",\"name\":\"%s\",\"offset\":%u,"
+            "\"address\":%u,\"value\":%u}", first ? "" : ",",
+            reg_module[reg_def[i].module], block_name(reg_def[i].block),
+            reg_def[i].name, reg_def[i].offset,
+            BCM2835_PHY_BASE + reg_info[reg_def[i].block].offset + reg_def[i].offset,
+            snap->value[i]);
+        first = 0;
+    }
+    printf("\n]}\n");
+}
+
+// find a register by name, with or without BCM2835_, optionally as
+// BLOCK.NAME where several blocks have it (BSC1.BSC_S); -1 if unknown
+int reg_lookup(char *name)
+{
+    char *dot = strchr(name, '.');
+    char *reg = dot ? dot + 1 : name;
+    char *block;
+    int len = strlen("BCM2835_");
+    int i;
+
+    for(i=0; i<REG_COUNT; i++) {
+        block = block_name(reg_def[i].block);
+        if(dot && (strlen(block) != dot - name || strncmp(block, name, dot - name) != 0))
+            continue;
+        if(strcmp(reg_def[i].name, reg) == 0 || strcmp(reg_def[i].name + len, reg) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Watch mode: poll a few registers as fast as the bus allows. Only changes
+// are kept, as records in a ring; a record that falls off the ring is
+// folded into base[], so base[] plus the ring always gives the full state.
+#define WATCH_MAX 32
+#define WATCH_RING_MAX (1<<26)    // records, 1 GiB, fits a 32 bit size_t
+
+typedef enum
+{
+    TRIG_NONE = 0,
+    TRIG_MATCH,     // (value & mask) == match
+    TRIG_RISE,      // a bit of mask went 0->1
+    TRIG_FALL,      // a bit of mask went 1->0
+    TRIG_EDGE,      // a bit of mask changed
+} trig_type_st;
+
+char *trig_type[] = {
+    "none",
+    "match",
+    "rise",
+    "fall",
+    "edge",
+};
+
+typedef struct {
+    uint32_t seq;       // sample number
+    uint32_t clo;       // ST_CLO at the start of the sample
+    uint32_t value;
+    uint32_t reg;       // index in the watch list
+} watch_rec_st;
+
+typedef struct {
+    int      count;
+    int      reg[WATCH_MAX];        // reg_def[] indexes
+    char     label[WATCH_MAX][32];  // BLOCK.NAME, as -w takes them
+    uint32_t base[WATCH_MAX];       // values before the oldest record
+    watch_rec_st *ring;
+    uint32_t size;                  // records, a power of 2
+    uint32_t head;
+    uint32_t tail;
+    uint32_t evicted_seq;           // of the last record folded into base
+    int      evicted;
+
+    trig_type_st trig;
+    int      trig_reg;              // index in the watch list
+    uint32_t trig_value;
+    uint32_t trig_mask;
+    uint32_t pre;                   // samples kept before the trigger
+    uint32_t post;                  // samples taken after it
+
+    int      triggered;
+    uint32_t trig_seq;
+    uint32_t trig_clo;
+    uint32_t samples;
+    uint32_t clo_start;
+    uint32_t clo_end;
+} watch_st;
+
+volatile sig_atomic_t watch_stop;
+
+void watch_signal(int sig)
+{
+    (void)sig;
+    watch_stop = 1;
+}
+
+int watch_add(watch_st *w, char *name)
+{
+    int r = reg_lookup(name);
+    int i;
+
+    if(r < 0) {
+        fprintf(stderr, "unknown register %s\n", name);
+        return -1;
+    }
+    if(reg_def[r].flags & REG_F_POP) {
+        fprintf(stderr, "%s: polling would drain its FIFO\n", name);
+        return -1;
+    }
+    for(i=0; i<w->count; i++) {
+        if(w->reg[i] == r)
+            return i;
+    }
+    if(w->count == WATCH_MAX) {
+        fprintf(stderr, "at most %d registers can be watched\n", WATCH_MAX);
+        return -1;
+    }
+    w->reg[w->count] = r;
+    snprintf(w->label[w->count], sizeof(w->label[0]), "%s.%s",
+        block_name(reg_def[r].block), reg_def[r].name + strlen("BCM2835_"));
+    return w->count++;
+}
+
+// comma separated register names
+int watch_parse_regs(watch_st *w, char *list)
+{
+    char *name;
+
+    for(name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+        if(watch_add(w, name) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// REG:match:VALUE[:MASK] or REG:rise|fall|edge[:MASK]
+int watch_parse_trigger(watch_st *w, char *spec)
+{
+    char *type = strchr(spec, ':');
+    char *arg;
+    int i;
+
+    if(type == NULL)
+        return -1;
+    *type++ = 0;
+    arg = strchr(type, ':');
+    if(arg)
+        *arg++ = 0;
+
+    for(i=TRIG_MATCH; i<sizeof(trig_type)/sizeof(trig_type[0]); i++) {
+        if(strcmp(trig_type[i], type) == 0)
+            break;
+    }
+    if(i == sizeof(trig_type)/sizeof(trig_type[0]))
+        return -1;
+    w->trig = i;
+    w->trig_mask = 0xffffffff;
+    if(w->trig == TRIG_MATCH) {
+        if(arg == NULL)
+            return -1;
+        w->trig_value = strtoul(arg, &arg, 0);
+        if(*arg == ':')
+            arg++;
+        else if(*arg)
+            return -1;
+    }
+    if(arg && *arg)
+        w->trig_mask = strtoul(arg, NULL, 0);
+
+    w->trig_reg = watch_add(w, spec);
+    return w->trig_reg < 0 ? -1 : 0;
+}
+
+int watch_alloc(watch_st *w, uint32_t size)
+{
+    w->size = 1;
+    while(w->size < size)
+        w->size <<= 1;
+    w->ring = malloc(w->size * sizeof(*w->ring));
+    if(w->ring == NULL) {
+        perror("watch ring");
+        return -1;
+    }
+    // fault the pages in now rather than in the poll loop
+    memset(w->ring, 0, w->size * sizeof(*w->ring));
+    return 0;
+}
+
+int watch_fire(watch_st *w, uint32_t old, uint32_t val)
+{
+    switch(w->trig) {
+    case TRIG_NONE:  return 1;
+    case TRIG_MATCH: return (val & w->trig_mask) == w->trig_value;
+    case TRIG_RISE:  return (~old & val & w->trig_mask) != 0;
+    case TRIG_FALL:  return (old & ~val & w->trig_mask) != 0;
+    case TRIG_EDGE:  return ((old ^ val) & w->trig_mask) != 0;
+    }
+    return 0;
+}
+
+void watch_run(watch_st *w)
+{
+    volatile uint32_t *addr[WATCH_MAX];
+    uint32_t prev[WATCH_MAX];
+    uint32_t mask = w->size - 1;
+    uint32_t old, val, clo, seq, stop_seq = 0;
+    watch_rec_st *rec;
+    int i;
+
+    for(i=0; i<w->count; i++) {
+        addr[i] = reg_addr[w->reg[i]];
+        prev[i] = w->base[i] = REG_READ(addr[i]);
+    }
+    w->head = w->tail = 0;
+    w->evicted = 0;
+    w->triggered = 0;
+
+    signal(SIGINT, watch_signal);
+    w->clo_start = REG_READ(st_clo);
+    for(seq = 0; !watch_stop; seq++) {
+        clo = REG_READ(st_clo);
+        old = prev[w->trig_reg];
+        for(i=0; i<w->count; i++) {
+            val = REG_READ(addr[i]);
+            if(val == prev[i])
+                continue;
+            prev[i] = val;
+            if(w->head - w->tail == w->size) {
+                rec = &w->ring[w->tail++ & mask];
+                w->base[rec->reg] = rec->value;
+                w->evicted_seq = rec->seq;
+                w->evicted = 1;
+            }
+            rec = &w->ring[w->head++ & mask];
+            rec->seq   = seq;
+            rec->clo   = clo;
+            rec->value = val;
+            rec->reg   = i;
+        }
+        if(w->triggered) {
+            if(seq == stop_seq)
+                break;
+        } else if(watch_fire(w, old, prev[w->trig_reg])) {
+            w->triggered = 1;
+            w->trig_seq  = seq;
+            w->trig_clo  = clo;
+            stop_seq     = seq + w->post;
+            if(seq == stop_seq)
+                break;
+        }
+    }
+    w->clo_end = REG_READ(st_clo);
+    w->samples = watch_stop ? seq : seq + 1;
+    signal(SIGINT, SIG_DFL);
+}
+
+void watch_print(watch_st *w, format_st format)
+{
+    uint32_t first = 0;
+    uint32_t t0 = w->triggered ? w->trig_clo : w->clo_start;
+    uint32_t us = w->clo_end - w->clo_start;
+    uint32_t n;
+    watch_rec_st *rec;
+    int lost;
+    int i;
+
+    // drop what is older than the pre-trigger window
+    if(w->triggered && w->trig_seq > w->pre)
+        first = w->trig_seq - w->pre;
+    while(w->tail != w->head && w->ring[w->tail & (w->size - 1)].seq < first) {
+        rec = &w->ring[w->tail++ & (w->size - 1)];
+        w->base[rec->reg] = rec->value;
+    }
+    // base[] is the state as of the last change lost to a full ring
+    lost = w->evicted && w->evicted_seq >= first;
+    if(lost)
+        first = w->evicted_seq;
+
+    if(format == FMT_CSV) {
+        printf("sample,st_clo,register,value\n");
+    } else if(format == FMT_JSON) {
+        printf("{\"samples\":%u,\"us\":%u,\"triggered\":%s,\"trigger_sample\":%u,"
+            "\"first_sample\":%u,\"initial\":{", w->samples, us,
+            w->triggered ? "true" : "false", w->trig_seq, first);
+        for(i=0; i<w->count; i++) {
+            printf("%s\"%s\":%u", i ? "," : "", w->label[i], w->base[i]);
+        }
+        printf("},\"changes\":[");
+    } else {
+        printf("%u samples in %u us (%.1f kHz), %u changes\n", w->samples, us,
+            us ? (double)w->samples / us * 1000 : 0.0, w->head - w->tail);
+        if(w->trig != TRIG_NONE) {
+            if(w->triggered)
+                printf("trigger %s %s at sample %u, ST_CLO 0x%08x\n",
+                    w->label[w->trig_reg], trig_type[w->trig],
+                    w->trig_seq, w->trig_clo);
+            else
+                printf("trigger %s %s never fired\n",
+                    w->label[w->trig_reg], trig_type[w->trig]);
+        }
+        if(lost)
+            printf("ring overflowed, changes up to sample %u are lost\n", first);
+        printf("\n%-10s %-10s %-8s %-25s %-10s\n", "Sample", "ST_CLO", "us",
+            "Register Name", "Value");
+        for(i=0; i<w->count; i++) {
+            printf("%-10u %-10s %-8s %-25s 0x%08x\n", first, "", "",
+                w->label[i], w->base[i]);
+        }
+    }
+
+    for(n = w->tail; n != w->head; n++) {
+        rec = &w->ring[n & (w->size - 1)];
+        if(format == FMT_CSV)
+            printf("%u,0x%08x,%s,0x%08x\n", rec->seq, rec->clo,
+                w->label[rec->reg], rec->value);
+        else if(format == FMT_JSON)
+            printf("%s\n{\"sample\":%u,\"st_clo\":%u,\"name\":\"%s\",\"value\":%u}",
+                n != w->tail ? "," : "", rec->seq, rec->clo,
+                w->label[rec->reg], rec->value);
+        else
+            printf("%-10u 0x%08x %+-8d %-25s 0x%08x\n", rec->seq, rec->clo,
+                (int32_t)(rec->clo - t0), w->label[rec->reg], rec->value);
+    }
+    if(format == FMT_JSON)
+        printf("\n]}\n");
+}
+
+// Logic analyzer: sample GPLEV0/1 in blocks as fast as the bus allows. ST_CLO
+// is read around each block and its samples are spread evenly over that
+// time, ST only counts microseconds. Transitions are found by XORing each
+// sample with the one before it over a whole block, a loop the compiler
+// vectorizes, and only the changes are kept: each holds until the next.
+#define LA_BLOCK 1024
+
+typedef struct {
+    uint64_t t_ns;      // since the capture started
+    uint32_t lev[2];    // GPLEV0, GPLEV1 of the captured pins
+} la_change_st;
+
+typedef struct {
+    uint32_t mask[2];   // GPIO 0-31, 32-53 to capture
+    la_change_st *change;
+    uint32_t count;
+    uint32_t alloc;
+    uint64_t samples;
+    uint32_t us;        // ST_CLO time of the capture
+    uint32_t busy_us;   // of which spent reading samples
+    int      truncated;
+} la_st;
+
+int la_add(la_st *la, uint64_t t_ns, uint32_t lev0, uint32_t lev1)
+{
+    la_change_st *change;
+
+    if(la->count == la->alloc) {
+        change = realloc(la->change, (la->alloc ? la->alloc * 2 : 4096) * sizeof(*change));
+        if(change == NULL) {
+            la->truncated = 1;
+            return -1;
+        }
+        la->change = change;
+        la->alloc = la->alloc ? la->alloc * 2 : 4096;
+    }
+    change = &la->change[la->count++];
+    change->t_ns   = t_ns;
+    change->lev[0] = lev0;
+    change->lev[1] = lev1;
+    return 0;
+}
+
+// diff[i] = pins that changed at sample i, returns all that changed
+uint32_t la_xor(uint32_t *diff, uint32_t *lev, uint32_t prev, uint32_t mask, int n)
+{
+    uint32_t any;
+    int i;
+
+    diff[0] = (lev[0] ^ prev) & mask;
+    any = diff[0];
+    for(i=1; i<n; i++) {
+        diff[i] = (lev[i] ^ lev[i-1]) & mask;
+        any |= diff[i];
+    }
+    return any;
+}
+
+void la_capture(la_st *la, uint64_t total)
+{
+    static uint32_t lev[2][LA_BLOCK];
+    static uint32_t diff[2][LA_BLOCK];
+    volatile uint32_t *gplev0 = reg_addr[reg_lookup("GPLEV0")];
+    volatile uint32_t *gplev1 = reg_addr[reg_lookup("GPLEV1")];
+    uint32_t prev[2], start, clo0, clo1, any;
+    uint64_t t_ns;
+    int i, n;
+
+    signal(SIGINT, watch_signal);
+    prev[0] = REG_READ(gplev0) & la->mask[0];
+    prev[1] = la->mask[1] ? REG_READ(gplev1) & la->mask[1] : 0;
+    start = REG_READ(st_clo);
+    la_add(la, 0, prev[0], prev[1]);
+
+    while(la->samples < total && !watch_stop && !la->truncated) {
+        n = total - la->samples < LA_BLOCK ? total - la->samples : LA_BLOCK;
+
+        clo0 = REG_READ(st_clo);
+        if(la->mask[1]) {
+            for(i=0; i<n; i++) {
+                lev[0][i] = REG_READ(gplev0);
+                lev[1][i] = REG_READ(gplev1);
+            }
+        } else {
+            for(i=0; i<n; i++)
+                lev[0][i] = REG_READ(gplev0);
+        }
+        clo1 = REG_READ(st_clo);
+        la->busy_us += clo1 - clo0;
+
+        any = la_xor(diff[0], lev[0], prev[0], la->mask[0], n);
+        if(la->mask[1])
+            any |= la_xor(diff[1], lev[1], prev[1], la->mask[1], n);
+        if(any) {
+            for(i=0; i<n; i++) {
+                if(!(diff[0][i] | diff[1][i]))
+                    continue;
+                t_ns = (uint64_t)(clo0 - start) * 1000 +
+                    (uint64_t)(clo1 - clo0) * 1000 * i / n;
+                if(la_add(la, t_ns, lev[0][i] & la->mask[0], lev[1][i] & la->mask[1]) < 0)
+                    break;
+            }
+        }
+        prev[0] = lev[0][n-1] & la->mask[0];
+        prev[1] = lev[1][n-1] & la->mask[1];
+        la->samples += n;
+    }
+    la->us = REG_READ(st_clo) - start;
+    signal(SIGINT, SIG_DFL);
+}
+
+// one wire per captured pin, named GPIOn, with 1ns resolution
+int la_write_vcd(la_st *la, char *filename)
+{
+    uint32_t diff;
+    FILE *fp;
+    int pin, bank, i;
+
+    fp = fopen(filename, "w");
+    if(fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    fprintf(fp, "$version dump_reg $end\n$timescale 1ns $end\n$scope module gpio $end\n");
+    for(pin=0; pin<54; pin++) {
+        if(la->mask[pin/32] & 1U<<(pin%32))
+            fprintf(fp, "$var wire 1 %c GPIO%d $end\n", '!' + pin, pin);
+    }
+    fprintf(fp, "$upscope $end\n$enddefinitions $end\n");
+
+    for(i=0; i<la->count; i++) {
+        fprintf(fp, "#%llu\n", (unsigned long long)la->change[i].t_ns);
+        if(i == 0)
+            fprintf(fp, "$dumpvars\n");
+        for(bank=0; bank<2; bank++) {
+            diff = i ? la->change[i].lev[bank] ^ la->change[i-1].lev[bank] : la->mask[bank];
+            for(pin=0; diff; pin++, diff>>=1) {
+                if(diff & 1)
+                    fprintf(fp, "%d%c\n", (la->change[i].lev[bank] >> pin) & 1, '!' + bank*32 + pin);
+            }
+        }
+        if(i == 0)
+            fprintf(fp, "$end\n");
+    }
+    if(la->count && la->us * 1000ULL > la->change[la->count-1].t_ns)
+        fprintf(fp, "#%llu\n", la->us * 1000ULL);
+
+    if(fclose(fp) != 0) {
+        perror(filename);
+        return -1;
+    }
+    return 0;
+}
+
+void la_report(la_st *la)
+{
+    printf("%llu samples in %u us (%.3f MS/s), reading %.1f%% of the time\n",
+        (unsigned long long)la->samples, la->us,
+        la->us ? (double)la->samples / la->us : 0.0,
+        la->us ? 100.0 * la->busy_us / la->us : 0.0);
+    printf("%u transitions, %lu bytes stored%s\n", la->count - 1,
+        (unsigned long)(la->count * sizeof(la_change_st)),
+        la->truncated ? ", out of memory: capture cut short" : "");
+}
+
+// Named bitfields for the diff, from the datasheet sections in reg_info[].
+// GPFSELn and the one bit per pin GPIO registers are decoded by pin instead.
+typedef struct {
+    char *   reg;       // reg_def[] name
+    uint8_t  shift;
+    uint8_t  width;
+    char *   name;
+} field_st;
+
+#define FIELD(reg, shift, width, name) \
+    { #reg, shift, width, name }
+
+field_st reg_field[] = {
+    FIELD(BCM2835_PWM_CONTROL   ,  0,  1, "PWEN1"     ),
+    FIELD(BCM2835_PWM_CONTROL   ,  1,  1, "MODE1"     ),
+    FIELD(BCM2835_PWM_CONTROL   ,  2,  1, "RPTL1"     ),
+    FIELD(BCM2835_PWM_CONTROL   ,  3,  1, "SBIT1"     ),
+    FIELD(BCM2835_PWM_CONTROL   ,  4,  1, "POLA1"     ),
+    FIELD(BCM2835_PWM_CONTROL   ,  5,  1, "USEF1"     ),
+    FIELD(BCM2835_PWM_CONTROL   ,  6,  1, "CLRF1"     ),
+    FIELD(BCM2835_PWM_CONTROL   ,  7,  1, "MSEN1"     ),
+    FIELD(BCM2835_PWM_CONTROL   ,  8,  1, "PWEN2"     ),
+    FIELD(BCM2835_PWM_CONTROL   ,  9,  1, "MODE2"     ),
+    FIELD(BCM2835_PWM_CONTROL   , 10,  1, "RPTL2"     ),
+    FIELD(BCM2835_PWM_CONTROL   , 11,  1, "SBIT2"     ),
+    FIELD(BCM2835_PWM_CONTROL   , 12,  1, "POLA2"     ),
+    FIELD(BCM2835_PWM_CONTROL   , 13,  1, "USEF2"     ),
+    FIELD(BCM2835_PWM_CONTROL   , 15,  1, "MSEN2"     ),
+    FIELD(BCM2835_PWM_STATUS    ,  0,  1, "FULL1"     ),
+    FIELD(BCM2835_PWM_STATUS    ,  1,  1, "EMPT1"     ),
+    FIELD(BCM2835_PWM_STATUS    ,  2,  1, "WERR1"     ),
+    FIELD(BCM2835_PWM_STATUS    ,  3,  1, "RERR1"     ),
+    FIELD(BCM2835_PWM_STATUS    ,  4,  1, "GAPO1"     ),
+    FIELD(BCM2835_PWM_STATUS    ,  5,  1, "GAPO2"     ),
+    FIELD(BCM2835_PWM_STATUS    ,  6,  1, "GAPO3"     ),
+    FIELD(BCM2835_PWM_STATUS    ,  7,  1, "GAPO4"     ),
+    FIELD(BCM2835_PWM_STATUS    ,  8,  1, "BERR"      ),
+    FIELD(BCM2835_PWM_STATUS    ,  9,  1, "STA1"      ),
+    FIELD(BCM2835_PWM_STATUS    , 10,  1, "STA2"      ),
+    FIELD(BCM2835_PWM_STATUS    , 11,  1, "STA3"      ),
+    FIELD(BCM2835_PWM_STATUS    , 12,  1, "STA4"      ),
+    FIELD(BCM2835_PWM_DMAC      ,  0,  8, "DREQ"      ),
+    FIELD(BCM2835_PWM_DMAC      ,  8,  8, "PANIC"     ),
+    FIELD(BCM2835_PWM_DMAC      , 31,  1, "ENAB"      ),
+    FIELD(BCM2835_BSC_C         ,  0,  1, "READ"      ),
+    FIELD(BCM2835_BSC_C         ,  4,  2, "CLEAR"     ),
+    FIELD(BCM2835_BSC_C         ,  7,  1, "ST"        ),
+    FIELD(BCM2835_BSC_C         ,  8,  1, "INTD"      ),
+    FIELD(BCM2835_BSC_C         ,  9,  1, "INTT"      ),
+    FIELD(BCM2835_BSC_C         , 10,  1, "INTR"      ),
+    FIELD(BCM2835_BSC_C         , 15,  1, "I2CEN"     ),
+    FIELD(BCM2835_BSC_S         ,  0,  1, "TA"        ),
+    FIELD(BCM2835_BSC_S         ,  1,  1, "DONE"      ),
+    FIELD(BCM2835_BSC_S         ,  2,  1, "TXW"       ),
+    FIELD(BCM2835_BSC_S         ,  3,  1, "RXR"       ),
+    FIELD(BCM2835_BSC_S         ,  4,  1, "TXD"       ),
+    FIELD(BCM2835_BSC_S         ,  5,  1, "RXD"       ),
+    FIELD(BCM2835_BSC_S         ,  6,  1, "TXE"       ),
+    FIELD(BCM2835_BSC_S         ,  7,  1, "RXF"       ),
+    FIELD(BCM2835_BSC_S         ,  8,  1, "ERR"       ),
+    FIELD(BCM2835_BSC_S         ,  9,  1, "CLKT"      ),
+    FIELD(BCM2835_BSC_DLEN      ,  0, 16, "DLEN"      ),
+    FIELD(BCM2835_BSC_A         ,  0,  7, "ADDR"      ),
+    FIELD(BCM2835_BSC_DIV       ,  0, 16, "CDIV"      ),
+    FIELD(BCM2835_BSC_DEL       ,  0, 16, "REDL"      ),
+    FIELD(BCM2835_BSC_DEL       , 16, 16, "FEDL"      ),
+    FIELD(BCM2835_BSC_CLKT      ,  0, 16, "TOUT"      ),
+    FIELD(BCM2835_SPI0_CS       ,  0,  2, "CS"        ),
+    FIELD(BCM2835_SPI0_CS       ,  2,  1, "CPHA"      ),
+    FIELD(BCM2835_SPI0_CS       ,  3,  1, "CPOL"      ),
+    FIELD(BCM2835_SPI0_CS       ,  4,  2, "CLEAR"     ),
+    FIELD(BCM2835_SPI0_CS       ,  6,  1, "CSPOL"     ),
+    FIELD(BCM2835_SPI0_CS       ,  7,  1, "TA"        ),
+    FIELD(BCM2835_SPI0_CS       ,  8,  1, "DMAEN"     ),
+    FIELD(BCM2835_SPI0_CS       ,  9,  1, "INTD"      ),
+    FIELD(BCM2835_SPI0_CS       , 10,  1, "INTR"      ),
+    FIELD(BCM2835_SPI0_CS       , 11,  1, "ADCS"      ),
+    FIELD(BCM2835_SPI0_CS       , 12,  1, "REN"       ),
+    FIELD(BCM2835_SPI0_CS       , 13,  1, "LEN"       ),
+    FIELD(BCM2835_SPI0_CS       , 14,  1, "LMONO"     ),
+    FIELD(BCM2835_SPI0_CS       , 15,  1, "TE_EN"     ),
+    FIELD(BCM2835_SPI0_CS       , 16,  1, "DONE"      ),
+    FIELD(BCM2835_SPI0_CS       , 17,  1, "RXD"       ),
+    FIELD(BCM2835_SPI0_CS       , 18,  1, "TXD"       ),
+    FIELD(BCM2835_SPI0_CS       , 19,  1, "RXR"       ),
+    FIELD(BCM2835_SPI0_CS       , 20,  1, "RXF"       ),
+    FIELD(BCM2835_SPI0_CS       , 21,  1, "CSPOL0"    ),
+    FIELD(BCM2835_SPI0_CS       , 22,  1, "CSPOL1"    ),
+    FIELD(BCM2835_SPI0_CS       , 23,  1, "CSPOL2"    ),
+    FIELD(BCM2835_SPI0_CS       , 24,  1, "DMA_LEN"   ),
+    FIELD(BCM2835_SPI0_CS       , 25,  1, "LEN_LONG"  ),
+    FIELD(BCM2835_SPI0_CLK      ,  0, 16, "CDIV"      ),
+    FIELD(BCM2835_SPI0_DLEN     ,  0, 16, "LEN"       ),
+    FIELD(BCM2835_SPI0_LTOH     ,  0,  4, "TOH"       ),
+    FIELD(BCM2835_SPI0_DC       ,  0,  8, "TDREQ"     ),
+    FIELD(BCM2835_SPI0_DC       ,  8,  8, "TPANIC"    ),
+    FIELD(BCM2835_SPI0_DC       , 16,  8, "RDREQ"     ),
+    FIELD(BCM2835_SPI0_DC       , 24,  8, "RPANIC"    ),
+    FIELD(BCM2835_AUX_IRQ       ,  0,  1, "MU"        ),
+    FIELD(BCM2835_AUX_IRQ       ,  1,  1, "SPI1"      ),
+    FIELD(BCM2835_AUX_IRQ       ,  2,  1, "SPI2"      ),
+    FIELD(BCM2835_AUX_ENABLE    ,  0,  1, "MU"        ),
+    FIELD(BCM2835_AUX_ENABLE    ,  1,  1, "SPI1"      ),
+    FIELD(BCM2835_AUX_ENABLE    ,  2,  1, "SPI2"      ),
+    FIELD(BCM2835_AUX_SPI_CNTL0 ,  0,  6, "SHIFT_LEN" ),
+    FIELD(BCM2835_AUX_SPI_CNTL0 ,  6,  1, "MSB_OUT"   ),
+    FIELD(BCM2835_AUX_SPI_CNTL0 ,  7,  1, "INVERT_CLK"),
+    FIELD(BCM2835_AUX_SPI_CNTL0 ,  8,  1, "OUT_RISING"),
+    FIELD(BCM2835_AUX_SPI_CNTL0 ,  9,  1, "CLEAR_FIFO"),
+    FIELD(BCM2835_AUX_SPI_CNTL0 , 10,  1, "IN_RISING" ),
+    FIELD(BCM2835_AUX_SPI_CNTL0 , 11,  1, "ENABLE"    ),
+    FIELD(BCM2835_AUX_SPI_CNTL0 , 12,  2, "DOUT_HOLD" ),
+    FIELD(BCM2835_AUX_SPI_CNTL0 , 14,  1, "VAR_WIDTH" ),
+    FIELD(BCM2835_AUX_SPI_CNTL0 , 15,  1, "VAR_CS"    ),
+    FIELD(BCM2835_AUX_SPI_CNTL0 , 16,  1, "POST_INPUT"),
+    FIELD(BCM2835_AUX_SPI_CNTL0 , 17,  3, "CS"        ),
+    FIELD(BCM2835_AUX_SPI_CNTL0 , 20, 12, "SPEED"     ),
+    FIELD(BCM2835_AUX_SPI_CNTL1 ,  0,  1, "KEEP_INPUT"),
+    FIELD(BCM2835_AUX_SPI_CNTL1 ,  1,  1, "MSB_IN"    ),
+    FIELD(BCM2835_AUX_SPI_CNTL1 ,  6,  1, "DONE_IRQ"  ),
+    FIELD(BCM2835_AUX_SPI_CNTL1 ,  7,  1, "TXE_IRQ"   ),
+    FIELD(BCM2835_AUX_SPI_CNTL1 ,  8,  3, "CS_HIGH"   ),
+    FIELD(BCM2835_AUX_SPI_STAT  ,  0,  6, "BIT_COUNT" ),
+    FIELD(BCM2835_AUX_SPI_STAT  ,  6,  1, "BUSY"      ),
+    FIELD(BCM2835_AUX_SPI_STAT  ,  7,  1, "RX_EMPTY"  ),
+    FIELD(BCM2835_AUX_SPI_STAT  ,  8,  1, "RX_FULL"   ),
+    FIELD(BCM2835_AUX_SPI_STAT  ,  9,  1, "TX_EMPTY"  ),
+    FIELD(BCM2835_AUX_SPI_STAT  , 10,  1, "TX_FULL"   ),
+    FIELD(BCM2835_AUX_SPI_STAT  , 16,  8, "RX_LVL"    ),
+    FIELD(BCM2835_AUX_SPI_STAT  , 24,  8, "TX_LVL"    ),
+    FIELD(BCM2835_GPPUD         ,  0,  2, "PUD"       ),
+    FIELD(BCM2835_ST_CS         ,  0,  1, "M0"        ),
+    FIELD(BCM2835_ST_CS         ,  1,  1, "M1"        ),
+    FIELD(BCM2835_ST_CS         ,  2,  1, "M2"        ),
+    FIELD(BCM2835_ST_CS         ,  3,  1, "M3"        ),
+};
+
+// GPFSEL function codes
+char *fsel_name[] = {
+    "input",
+    "output",
+    "ALT5",
+    "ALT4",
+    "ALT0",
+    "ALT1",
+    "ALT2",
+    "ALT3",
+};
+
+// x[i] = bits that differ between a[i] and b[i], returns all that do;
+// the compiler vectorizes this over the whole register image
+uint32_t snapshot_xor(uint32_t *x, uint32_t *a, uint32_t *b, int n)
+{
+    uint32_t any = 0;
+    int i;
+
+    for(i=0; i<n; i++) {
+        x[i] = a[i] ^ b[i];
+        any |= x[i];
+    }
+    return any;
+}
+
+// where diff lines go: CSV and JSON rows name the snapshot pair they are from
+typedef struct {
+    format_st format;
+    char *    a;
+    char *    b;
+    int       rows;
+} diff_out_st;
+
+void diff_line(diff_out_st *out, int reg, char *sep, char *field, char *from, char *to)
+{
+    char *name = reg_def[reg].name + strlen("BCM2835_");
+
+    switch(out->format) {
+    case FMT_TEXT:
+        printf("    %s%s%s%s %s->%s\n", name, sep, field, *sep == ' ' ? ":" : "", from, to);
+        break;
+    case FMT_CSV:
+        printf("%s,%s,%s,%s,%s,%s,%s\n", out->a, out->b, block_name(reg_def[reg].block),
+            name, field, from, to);
+        break;
+    case FMT_JSON:
+        printf("%s\n{\"from\":\"%s\",\"to\":\"%s\",\"block\":\"%s\",\"register\":\"%s\","
+            "\"field\":\"%s\",\"old\":\"%s\",\"new\":\"%s\"}", out->rows ? "," : "",
+            out->a, out->b, block_name(reg_def[reg].block), name, field, from, to);
+        break;
+    }
+    out->rows++;
+}
+
+#define GPIO_PINS 54
+
+// one line per changed field or pin, then the whole register if bits
+// outside of them changed too
+void diff_fields(diff_out_st *out, int reg, uint32_t old, uint32_t new)
+{
+    char *name = reg_def[reg].name;
+    uint32_t x = old ^ new;
+    uint32_t rest = x;
+    uint32_t mask;
+    char field[16], from[16], to[16];
+    int bank = name[strlen(name)-1] - '0';
+    int i, shift;
+
+    if(strncmp(name, "BCM2835_GPFSEL", strlen("BCM2835_GPFSEL")) == 0) {
+        for(i=0; i<10 && bank*10 + i < GPIO_PINS; i++) {
+            shift = i * 3;
+            rest &= ~(7U << shift);
+            if(!(x >> shift & 7))
+                continue;
+            snprintf(field, sizeof(field), "pin %d", bank*10 + i);
+            diff_line(out, reg, " ", field, fsel_name[old >> shift & 7], fsel_name[new >> shift & 7]);
+        }
+    } else if(reg_def[reg].module == REG_GPIO && strcmp(name, "BCM2835_GPPUD") != 0) {
+        // GPSETn, GPLEVn, GPRENn...: bit i is pin n*32+i
+        for(i=0; i<32 && bank*32 + i < GPIO_PINS; i++) {
+            rest &= ~(1U << i);
+            if(!(x >> i & 1))
+                continue;
+            snprintf(field, sizeof(field), "pin %d", bank*32 + i);
+            diff_line(out, reg, " ", field, old >> i & 1 ? "1" : "0", new >> i & 1 ? "1" : "0");
+        }
+    } else {
+        for(i=0; i<sizeof(reg_field)/sizeof(reg_field[0]); i++) {
+            if(strcmp(reg_field[i].reg, name) != 0)
+                continue;
+            shift = reg_field[i].shift;
+            mask = (uint32_t)((1ULL << reg_field[i].width) - 1);
+            rest &= ~(mask << shift);
+            if(!(x >> shift & mask))
+                continue;
+            snprintf(from, sizeof(from), "%u", old >> shift & mask);
+            snprintf(to, sizeof(to), "%u", new >> shift & mask);
+            diff_line(out, reg, ".", reg_field[i].name, from, to);
+        }
+    }
+
+    if(rest) {
+        snprintf(from, sizeof(from), "0x%08x", old);
+        snprintf(to, sizeof(to), "0x%08x", new);
+        diff_line(out, reg, "", "", from, to);
+    }
+}
+
+// returns the number of registers that differ
+int snapshot_diff(snapshot_st *a, snapshot_st *b, uint32_t modules, diff_out_st *out)
+{
+    uint32_t x[REG_COUNT];
+    int i, changed = 0;
+
+    modules &= a->hdr.modules & b->hdr.modules;
+    if(snapshot_xor(x, a->value, b->value, REG_COUNT)) {
+        for(i=0; i<REG_COUNT; i++) {
+            if(x[i] && modules & 1<<reg_def[i].module)
+                changed++;
+        }
+    }
+    if(out->format == FMT_TEXT) {
+        printf("%s -> %s: %d registers changed, %u us apart\n", out->a, out->b, changed,
+            b->hdr.clo_start - a->hdr.clo_start);
+    }
+    for(i=0; i<REG_COUNT && changed; i++) {
+        if(!x[i] || !(modules & 1<<reg_def[i].module))
+            continue;
+        if(out->format == FMT_TEXT)
+            printf("%-9s %-25s 0x%08x -> 0x%08x\n", block_name(reg_def[i].block),
+                reg_def[i].name, a->value[i], b->value[i]);
+        diff_fields(out, i, a->value[i], b->value[i]);
+    }
+    return changed;
+}
+
+// -d: each snapshot against the next, or a single one against the window
+int diff_run(char **files, int count, uint32_t modules, format_st format,
+    char *map_file, int simulate)
+{
+    diff_out_st out = { format };
+    snapshot_st *snap;
+    int i;
+
+    snap = calloc(count + 1, sizeof(*snap));
+    if(snap == NULL) {
+        perror("snapshots");
+        return -1;
+    }
+    for(i=0; i<count; i++) {
+        if(snapshot_load(&snap[i], files[i]) < 0)
+            return -1;
+    }
+    if(count == 1) {
+        if(!window_open(map_file, simulate))
+            return -1;
+        snapshot_read(&snap[1], snap[0].hdr.modules);
+        files[1] = map_file ? map_file : "live";
+        count = 2;
+    }
+
+    if(format == FMT_CSV)
+        printf("from,to,block,register,field,old,new\n");
+    else if(format == FMT_JSON)
+        printf("[");
+    for(i=1; i<count; i++) {
+        out.a = files[i-1];
+        out.b = files[i];
+        snapshot_diff(&snap[i-1], &snap[i], modules, &out);
+    }
+    if(format == FMT_JSON)
+        printf("\n]\n");
+    free(snap);
+    return 0;
+}
+
 void usage()
 {
     int i;
 
-    printf("Usage dump_reg <module>\n  module: ");
+    printf("Usage dump_reg [-m file [-S]] [-f format] [-o file] [-M file] [-r file] <module>...\n");
+    printf("      dump_reg [-m file [-S]] [-f format] -w reg,... [-t trigger] [-b n] [-n n] [-s n]\n");
+    printf("      dump_reg [-m file [-S]] -l file.vcd [-g pins] [-n n]\n");
+    printf("      dump_reg [-m file [-S]] [-f format] -d file [-d file...] [module...]\n  module: ");
     for(i=0; i<sizeof(reg_module)/sizeof(reg_module[0]); i++) {
         printf("%s, ", reg_module[i]);
     }
-    printf("all.\n");
+    printf("all.\n  format: ");
+    for(i=0; i<sizeof(reg_format)/sizeof(reg_format[0]); i++) {
+        printf("%s%s", reg_format[i],
+            i+1 < sizeof(reg_format)/sizeof(reg_format[0]) ? ", " : ", default text.\n");
+    }
+    printf("  -o file: also save the register snapshot to file\n");
+    printf("  -r file: print a saved snapshot instead of reading the registers\n");
+    printf("  -w reg,...: watch registers, like SPI0_CS,BSC1.BSC_S,GPLEV0, and print\n"
+           "             every change with its ST_CLO\n");
+    printf("  -t reg:match:value[:mask], reg:rise|fall|edge[:mask]: start on a trigger\n");
+    printf("  -b n: keep n samples before the trigger, default 1000\n");
+    printf("  -n n: take n samples after the trigger, default 100000\n");
+    printf("  -s n: keep at most n changes, default 262144\n");
+    printf("  -l file.vcd: capture GPLEV0/1 like a logic analyzer, n samples\n");
+    printf("  -g pins: mask of the GPIOs to capture, default 0x0fffffff\n");
+    printf("  -m file: map a snapshot or a window image instead of /dev/mem\n");
+    printf("  -S: simulate ST and FIFO reads in a window mapped with -m\n");
+    printf("  -M file: also save the snapshot as a window image for -m\n");
+    printf("  -d file: show the registers that changed, down to their bitfields,\n"
+           "           from one snapshot to the next, or from one to now\n");
     exit(-1);
 }
 
 int main(int argc, char **argv)
 {
+    static snapshot_st snap;
+    static watch_st watch;
+    static la_st la;
+    uint64_t pins = 0x0fffffff;
+    char *vcd_file = NULL;
+    uint32_t ring_size = 1<<18;
     uint32_t verbose = 0;
-    int i;
+    format_st format = FMT_TEXT;
+    char *save_file = NULL;
+    char *read_file = NULL;
+    char *image_file = NULL;
+    char *map_file = NULL;
+    char **diff_file;
+    int diff_count = 0;
+    int simulate = 0;
+    int c, i, n;
+
+    diff_file = calloc(argc, sizeof(*diff_file));
+    if(diff_file == NULL)
+        return 1;
+    watch.pre  = 1000;
+    watch.post = 100000;
+
+    while((c = getopt(argc, argv, "f:o:r:w:t:b:n:s:l:g:m:SM:d:")) != -1) {
+        switch(c) {
+        case 'f':
+            for(i=0; i<sizeof(reg_format)/sizeof(reg_format[0]); i++) {
+                if(strcmp(reg_format[i], optarg) == 0)
+                    break;
+            }
+            if(i == sizeof(reg_format)/sizeof(reg_format[0]))
+                usage();
+            format = i;
+            break;
+        case 'o':
+            save_file = optarg;
+            break;
+        case 'r':
+            read_file = optarg;
+            break;
+        case 'w':
+            if(watch_parse_regs(&watch, optarg) < 0)
+                return 1;
+            break;
+        case 't':
+            if(watch_parse_trigger(&watch, optarg) < 0) {
+                fprintf(stderr, "bad trigger\n");
+                usage();
+            }
+            break;
+        case 'b':
+            watch.pre = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            watch.post = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            ring_size = strtoul(optarg, NULL, 0);
+            if(ring_size > WATCH_RING_MAX) {
+                fprintf(stderr, "at most %u changes can be kept\n", WATCH_RING_MAX);
+                usage();
+            }
+            break;
+        case 'l':
+            vcd_file = optarg;
+            break;
+        case 'g':
+            pins = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            map_file = optarg;
+            break;
+        case 'S':
+            simulate = 1;
+            break;
+        case 'M':
+            image_file = optarg;
+            break;
+        case 'd':
+            diff_file[diff_count++] = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if(simulate && map_file == NULL) {
+        fprintf(stderr, "-S needs a window mapped with -m\n");
+        usage();
+    }
+
+    if(vcd_file) {
+        if(optind < argc || read_file || save_file || image_file || watch.count || diff_count)
+            usage();
+        la.mask[0] = pins;
+        la.mask[1] = pins >> 32 & 0x3fffff;
+        if(!window_open(map_file, simulate))
+            return 1;
+        la_capture(&la, watch.post);
+        la_report(&la);
+        return la_write_vcd(&la, vcd_file) < 0;
+    }
 
-    if(argc < 2) {
+    if(watch.count) {
+        if(optind < argc || read_file || save_file || image_file || diff_count)
+            usage();
+        if(!window_open(map_file, simulate) || watch_alloc(&watch, ring_size) < 0)
+            return 1;
+        watch_run(&watch);
+        watch_print(&watch, format);
+        return 0;
+    }
+
+    if(optind >= argc && !diff_count) {
         usage();
     }
 
-    if (strncmp("all", argv[1], strlen("all")) == 0) {
-        verbose = (uint32_t)(-1);
-    } else {
+    for(n=optind; n<argc; n++) {
+        if (strncmp("all", argv[n], strlen("all")) == 0) {
+            verbose = (uint32_t)(-1);
+            continue;
+        }
         for(i=0; i<sizeof(reg_module)/sizeof(reg_module[0]); i++) {
-            if (strncmp(reg_module[i], argv[1], strlen(reg_module[i])) == 0) {
-                verbose = 1<<i;
+            if (strncmp(reg_module[i], argv[n], strlen(reg_module[i])) == 0) {
+                verbose |= 1<<i;
                 break;
             }
         }
+        if(i == sizeof(reg_module)/sizeof(reg_module[0])) {
+            usage();
+        }
     }
 
-    if(verbose == 0) {
-        usage();
+    if(diff_count) {
+        if(read_file || save_file || image_file)
+            usage();
+        return diff_run(diff_file, diff_count, optind < argc ? verbose : (uint32_t)(-1),
+            format, map_file, simulate) < 0;
     }
 
-    // bcm2835_set_debug(1);
-    bcm2835_init();
+    if(read_file) {
+        if(snapshot_load(&snap, read_file) < 0)
+            return 1;
+        // the base module is not part of a snapshot
+        snap.hdr.modules &= verbose;
+    } else {
+        if(!window_open(map_file, simulate))
+            return 1;
+        snapshot_read(&snap, verbose & ~(1<<REG_BASE));
+        if(save_file && snapshot_save(&snap, save_file) < 0)
+            return 1;
+        if(image_file && snapshot_save_image(&snap, image_file) < 0)
+            return 1;
+        if(format == FMT_TEXT && verbose & 1<<REG_BASE && !map_file)
+            bcm2835_dump_reg_base();
+    }
 
-    if(verbose & 1<<REG_BASE) bcm2835_dump_reg_base();
-    if(verbose & 1<<REG_GPIO) bcm2835_dump_reg_gpio();
-    if(verbose & 1<<REG_PWM)  bcm2835_dump_reg_pwm();
-    if(verbose & 1<<REG_BSC)  bcm2835_dump_reg_bsc();
-    if(verbose & 1<<REG_SPI)  bcm2835_dump_reg_spi();
-    if(verbose & 1<<REG_ST)   bcm2835_dump_reg_st();
+    switch(format) {
+    case FMT_TEXT: snapshot_print_text(&snap); break;
+    case FMT_CSV:  snapshot_print_csv(&snap);  break;
+    case FMT_JSON: snapshot_print_json(&snap); break;
+    }
 
     return 0;
 }
-
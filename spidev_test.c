@@ -9,31 +9,53 @@
  * the Free Software Foundation; either version 2 of the License.
  *
  * Cross-compile with cross-gcc -I/path/to/cross-kernel/include
+ * and link with -lpthread -lm.
  */
 
+#define _GNU_SOURCE
+
 #include <stdint.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <limits.h>
+#include <errno.h>
+#include <ctype.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
 #include <linux/ioctl.h>
 #include <sys/stat.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+
+#include "spidev_trace.h"
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
+/* largest N for which SPI_IOC_MESSAGE(N) still encodes a valid size */
+#define MAX_BATCH (((1 << _IOC_SIZEBITS) - 1) / sizeof(struct spi_ioc_transfer))
+
 static void pabort(const char *s)
 {
 	perror(s);
 	abort();
 }
 
-static const char *device = "/dev/spidev1.1";
 static uint32_t mode;
 static uint8_t bits = 8;
 static char *input_file;
@@ -44,6 +66,50 @@ static int verbose;
 static int transfer_size;
 static int iterations;
 static int interval = 5; /* interval in seconds for showing transfer rate */
+static int batch = 1;     /* segments packed into one SPI_IOC_MESSAGE */
+static int cs_change;     /* deselect between segments of a batch */
+static uint16_t seg_delay;
+static int lock_buffers;  /* mlock the transfer buffers */
+static uint64_t seed;
+static size_t chunk_size; /* stream --input in chunks of this size */
+static size_t out_buf_size = 1 << 20;
+static int out_sync;      /* fdatasync after every output flush */
+static int out_direct;    /* open the output with O_DIRECT */
+static int pipeline;      /* generate, transfer and verify on own threads */
+static int pipeline_depth = 8;
+static int stage_cpu[3] = { -1, -1, -1 };
+static int json;          /* report rates and latency as JSON lines */
+static char *sweep_spec;  /* parameter grid for --sweep */
+static int soak;          /* count loopback errors instead of exiting */
+static unsigned int soak_max_errors = 16;
+static char *checkpoint_file;
+static int checkpoint_interval = 60;
+static volatile sig_atomic_t stop;
+static size_t spidev_bufsiz;  /* largest message spidev accepts */
+static int cs_hold;       /* keep CS asserted across split messages */
+static const char *transport_name = "spidev";
+static uint32_t emu_latency;  /* per message overhead of the emulator, usec */
+static double emu_ber;    /* bit error rate injected by the emulator */
+static char *model_file;
+static int rt_prio;       /* SCHED_FIFO priority for --rt, 0 when off */
+static int rt_cpu = -1;
+static int rt_compare;    /* run -S once normally, then again with --rt */
+static double pace_rate;  /* messages per second for paced runs */
+static int pace_timerfd;  /* pace with a timerfd, not clock_nanosleep */
+static uint32_t pace_spin; /* busy wait the last usecs before a deadline */
+static char *script_file;  /* multi segment transaction for --script */
+static int half_duplex;   /* 'r' or 'w' for --half, plain read()/write() */
+static int uring_depth;   /* --half operations kept in flight, 0 for sync */
+static int adc_bits;      /* sample width for --adc, 0 when off */
+static int adc_ring = 64; /* captured frames buffered for the consumer */
+static int sd_mode;       /* run the SD card benchmark */
+static int sd_write;      /* let --sd overwrite the blocks it tests */
+static uint32_t sd_lba;
+static int sd_multi = 32; /* blocks per CMD18/CMD25 */
+static int cpu_cost;      /* report CPU cycles per byte and transfer */
+static char *trace_file;
+static unsigned int trace_sample = 16; /* payload bytes kept per traced message */
+static char *compare_transport; /* run -S again on this transport */
 
 uint8_t default_tx[] = {
 	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
@@ -113,371 +179,5103 @@ static int unescape(char *_dst, char *_src, size_t len)
 	return ret;
 }
 
-static void transfer(int fd, uint8_t const *tx, uint8_t const *rx, size_t len)
-{
-	int ret;
-	int out_fd;
-	struct spi_ioc_transfer tr = {
-		.tx_buf = (unsigned long)tx,
-		.rx_buf = (unsigned long)rx,
-		.len = len,
-		.delay_usecs = delay,
-		.speed_hz = speed,
-		.bits_per_word = bits,
-	};
+/*
+ * Log-linear latency histogram in the style of HdrHistogram: values below
+ * 2^HIST_SUB_BITS ns get a bucket each, every power of two above that is
+ * split into 2^HIST_SUB_BITS linear buckets, so any recorded latency is
+ * known to within ~3% at a fixed 15KB per histogram.
+ */
+#define HIST_SUB_BITS	5
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
 
-	if (mode & SPI_TX_QUAD)
-		tr.tx_nbits = 4;
-	else if (mode & SPI_TX_DUAL)
-		tr.tx_nbits = 2;
-	if (mode & SPI_RX_QUAD)
-		tr.rx_nbits = 4;
-	else if (mode & SPI_RX_DUAL)
-		tr.rx_nbits = 2;
-	if (!(mode & SPI_LOOP)) {
-		if (mode & (SPI_TX_QUAD | SPI_TX_DUAL))
-			tr.rx_buf = 0;
-		else if (mode & (SPI_RX_QUAD | SPI_RX_DUAL))
-			tr.tx_buf = 0;
-	}
-
-	ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr);
-	if (ret < 1)
-		pabort("can't send spi message");
+struct lat_hist {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t n;
+	uint64_t min;
+	uint64_t max;
+	double sum;
+	double sumsq;
+};
 
-	if (verbose)
-		hex_dump(tx, len, 32, "TX");
+static inline unsigned int hist_index(uint64_t v)
+{
+	int shift;
 
-	if (output_file) {
-		out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-		if (out_fd < 0)
-			pabort("could not open output file");
+	if (v < HIST_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + ((v >> shift) & (HIST_SUB - 1));
+}
 
-		ret = write(out_fd, rx, len);
-		if (ret != len)
-			pabort("not all bytes written to output file");
+/* highest value that lands in bucket @i */
+static uint64_t hist_value(unsigned int i)
+{
+	int shift;
 
-		close(out_fd);
-	}
+	if (i < HIST_SUB)
+		return i;
+	shift = (i >> HIST_SUB_BITS) - 1;
+	return ((uint64_t)(HIST_SUB + (i & (HIST_SUB - 1))) << shift) +
+	       (1ULL << shift) - 1;
+}
 
-	if (verbose)
-		hex_dump(rx, len, 32, "RX");
+static void hist_reset(struct lat_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
 }
 
-static void print_usage(const char *prog)
+static inline void hist_record(struct lat_hist *h, uint64_t v)
 {
-	printf("Usage: %s [-DsbdlHOLC3vpNR24SI]\n", prog);
-	puts("  -D --device   device to use (default /dev/spidev1.1)\n"
-	     "  -s --speed    max speed (Hz)\n"
-	     "  -d --delay    delay (usec)\n"
-	     "  -b --bpw      bits per word\n"
-	     "  -i --input    input data from a file (e.g. \"test.bin\")\n"
-	     "  -o --output   output data to a file (e.g. \"results.bin\")\n"
-	     "  -l --loop     loopback\n"
-	     "  -H --cpha     clock phase\n"
-	     "  -O --cpol     clock polarity\n"
-	     "  -L --lsb      least significant bit first\n"
-	     "  -C --cs-high  chip select active high\n"
-	     "  -3 --3wire    SI/SO signals shared\n"
-	     "  -v --verbose  Verbose (show tx buffer)\n"
-	     "  -p            Send data (e.g. \"1234\\xde\\xad\")\n"
-	     "  -N --no-cs    no chip select\n"
-	     "  -R --ready    slave pulls low to pause\n"
-	     "  -2 --dual     dual transfer\n"
-	     "  -4 --quad     quad transfer\n"
-	     "  -S --size     transfer size\n"
-	     "  -I --iter     iterations\n");
-	exit(1);
+	h->count[hist_index(v)]++;
+	h->n++;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->sum += v;
+	h->sumsq += (double)v * v;
 }
 
-static void parse_opts(int argc, char *argv[])
+static uint64_t hist_percentile(const struct lat_hist *h, double pct)
 {
-	while (1) {
-		static const struct option lopts[] = {
-			{ "device",  1, 0, 'D' },
-			{ "speed",   1, 0, 's' },
-			{ "delay",   1, 0, 'd' },
-			{ "bpw",     1, 0, 'b' },
-			{ "input",   1, 0, 'i' },
-			{ "output",  1, 0, 'o' },
-			{ "loop",    0, 0, 'l' },
-			{ "cpha",    0, 0, 'H' },
-			{ "cpol",    0, 0, 'O' },
-			{ "lsb",     0, 0, 'L' },
-			{ "cs-high", 0, 0, 'C' },
-			{ "3wire",   0, 0, '3' },
-			{ "no-cs",   0, 0, 'N' },
-			{ "ready",   0, 0, 'R' },
-			{ "dual",    0, 0, '2' },
-			{ "verbose", 0, 0, 'v' },
-			{ "quad",    0, 0, '4' },
-			{ "size",    1, 0, 'S' },
-			{ "iter",    1, 0, 'I' },
-			{ NULL, 0, 0, 0 },
-		};
-		int c;
+	uint64_t want = (uint64_t)(h->n * pct / 100.0 + 0.5);
+	uint64_t seen = 0;
+	unsigned int i;
 
-		c = getopt_long(argc, argv, "D:s:d:b:i:o:lHOLC3NR24p:vS:I:",
-				lopts, NULL);
+	if (!want)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= want)
+			return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+	return h->max;
+}
 
-		if (c == -1)
-			break;
+static double hist_mean(const struct lat_hist *h)
+{
+	return h->n ? h->sum / h->n : 0;
+}
 
-		switch (c) {
-		case 'D':
-			device = optarg;
-			break;
-		case 's':
-			speed = atoi(optarg);
-			break;
-		case 'd':
-			delay = atoi(optarg);
-			break;
-		case 'b':
-			bits = atoi(optarg);
-			break;
-		case 'i':
-			input_file = optarg;
-			break;
-		case 'o':
-			output_file = optarg;
-			break;
-		case 'l':
-			mode |= SPI_LOOP;
-			break;
-		case 'H':
-			mode |= SPI_CPHA;
-			break;
-		case 'O':
-			mode |= SPI_CPOL;
-			break;
-		case 'L':
-			mode |= SPI_LSB_FIRST;
-			break;
-		case 'C':
-			mode |= SPI_CS_HIGH;
-			break;
-		case '3':
-			mode |= SPI_3WIRE;
-			break;
-		case 'N':
-			mode |= SPI_NO_CS;
-			break;
-		case 'v':
-			verbose = 1;
-			break;
-		case 'R':
-			mode |= SPI_READY;
-			break;
-		case 'p':
-			input_tx = optarg;
-			break;
-		case '2':
-			mode |= SPI_TX_DUAL;
-			break;
-		case '4':
-			mode |= SPI_TX_QUAD;
-			break;
-		case 'S':
-			transfer_size = atoi(optarg);
-			break;
-		case 'I':
-			iterations = atoi(optarg);
-			break;
-		default:
-			print_usage(argv[0]);
-			break;
-		}
-	}
-	if (mode & SPI_LOOP) {
-		if (mode & SPI_TX_DUAL)
-			mode |= SPI_RX_DUAL;
-		if (mode & SPI_TX_QUAD)
-			mode |= SPI_RX_QUAD;
-	}
+/* standard deviation of the samples, reported as jitter */
+static double hist_jitter(const struct lat_hist *h)
+{
+	double mean = hist_mean(h);
+	double var;
+
+	if (h->n < 2)
+		return 0;
+	var = h->sumsq / h->n - mean * mean;
+	return var > 0 ? sqrt(var) : 0;
 }
 
-static void transfer_escaped_string(int fd, char *str)
+static const double hist_pcts[] = { 50, 90, 99, 99.9 };
+
+static void show_latency(const struct lat_hist *h, const char *label)
 {
-	size_t size = strlen(str);
-	uint8_t *tx;
-	uint8_t *rx;
+	unsigned int i;
 
-	tx = malloc(size);
-	if (!tx)
-		pabort("can't allocate tx buffer");
+	/* JSON callers have already written the comma before the key */
+	if (!h->n) {
+		if (json)
+			printf("\"%s\":null", label);
+		return;
+	}
 
-	rx = malloc(size);
-	if (!rx)
-		pabort("can't allocate rx buffer");
+	if (json) {
+		printf("\"%s\":{\"count\":%llu,\"min\":%.3f", label,
+		       (unsigned long long)h->n, h->min / 1e3);
+		for (i = 0; i < ARRAY_SIZE(hist_pcts); i++)
+			printf(",\"p%g\":%.3f", hist_pcts[i],
+			       hist_percentile(h, hist_pcts[i]) / 1e3);
+		printf(",\"max\":%.3f,\"mean\":%.3f,\"jitter\":%.3f}",
+		       h->max / 1e3, hist_mean(h) / 1e3, hist_jitter(h) / 1e3);
+		return;
+	}
 
-	size = unescape((char *)tx, str, size);
-	transfer(fd, tx, rx, size);
-	free(rx);
-	free(tx);
+	printf("%s: %llu samples, min %.1fus", label,
+	       (unsigned long long)h->n, h->min / 1e3);
+	for (i = 0; i < ARRAY_SIZE(hist_pcts); i++)
+		printf(", p%g %.1fus", hist_pcts[i],
+		       hist_percentile(h, hist_pcts[i]) / 1e3);
+	printf(", max %.1fus, jitter %.1fus\n",
+	       h->max / 1e3, hist_jitter(h) / 1e3);
 }
 
-static void transfer_file(int fd, char *filename)
+static inline uint64_t now_ns(void)
 {
-	ssize_t bytes;
-	struct stat sb;
-	int tx_fd;
-	uint8_t *tx;
-	uint8_t *rx;
+	struct timespec ts;
 
-	if (stat(filename, &sb) == -1)
-		pabort("can't stat input file");
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	tx_fd = open(filename, O_RDONLY);
-	if (tx_fd < 0)
-		pabort("can't open input file");
+/* loopback error accounting for --soak */
+struct soak_stats {
+	uint64_t bytes;		/* compared so far, also the stream offset */
+	uint64_t byte_errors;
+	uint64_t bit_errors;
+	uint64_t *err_offset;	/* offsets of the first soak_max_errors */
+	unsigned int nerr;
+	uint64_t prev_bytes;
+	uint64_t prev_bit_errors;
+	struct timespec start;
+	struct timespec last_report;
+	struct timespec last_checkpoint;
+};
 
-	tx = malloc(sb.st_size);
-	if (!tx)
-		pabort("can't allocate tx buffer");
+struct spi_dev;
 
-	rx = malloc(sb.st_size);
-	if (!rx)
-		pabort("can't allocate rx buffer");
+/*
+ * Everything that touches the SPI bus goes through one of these, so the
+ * benchmarks run the same way against the kernel's spidev, the built in
+ * emulator or a scripted peripheral model. setup() pushes the device's
+ * mode, bits and speed and reads them back; it returns NULL on success or
+ * a message saying what failed.
+ */
+struct spi_transport {
+	const char *name;
+	int (*open)(struct spi_dev *dev);
+	const char *(*setup)(struct spi_dev *dev);
+	int (*message)(struct spi_dev *dev, struct spi_ioc_transfer *tr, int n);
+	void (*close)(struct spi_dev *dev);
+};
 
-	bytes = read(tx_fd, tx, sb.st_size);
-	if (bytes != sb.st_size)
-		pabort("failed to read input file");
+/* fixed rate pacing state for --rate */
+struct pacer {
+	uint64_t period;
+	uint64_t next;		/* next deadline, CLOCK_MONOTONIC ns */
+	uint64_t start;
+	uint64_t frames;
+	uint64_t missed;
+	int tfd;
+	struct lat_hist late;
+};
 
-	transfer(fd, tx, rx, sb.st_size);
-	free(rx);
-	free(tx);
-	close(tx_fd);
-}
+/*
+ * One device under test. -D may be given several times; each device then
+ * gets its own worker thread, which is the only writer of its counters.
+ */
+struct spi_dev {
+	const char *path;
+	const struct spi_transport *ops;
+	void *priv;
+	int fd;
+	uint32_t mode;
+	uint8_t bits;
+	uint32_t speed;
+	int cpu;
 
-static uint64_t _read_count;
-static uint64_t _write_count;
+	uint64_t write_count;
+	uint64_t read_count;
+	uint64_t ioctl_count;
+	uint64_t prev_write_count;
+	uint64_t prev_read_count;
+	uint64_t prev_ioctl_count;
+	struct lat_hist lat_total;
+	struct lat_hist lat_interval;
+	struct soak_stats soak;
+	struct pacer pace;
+	struct trace_ring *trace;
+	double secs;
+	pthread_t thread;
+};
 
-static void show_transfer_rate(void)
-{
-	static uint64_t prev_read_count, prev_write_count;
-	double rx_rate, tx_rate;
+#define MAX_DEVICES 16
 
-	rx_rate = ((_read_count - prev_read_count) * 8) / (interval*1000.0);
-	tx_rate = ((_write_count - prev_write_count) * 8) / (interval*1000.0);
+static char *device_spec[MAX_DEVICES];
+static struct spi_dev devices[MAX_DEVICES];
+static int num_devices;
 
-	printf("rate: tx %.1fkbps, rx %.1fkbps\n", rx_rate, tx_rate);
+static void setup_transfer(struct spi_dev *dev, struct spi_ioc_transfer *tr,
+			   uint8_t const *tx, uint8_t const *rx, size_t len)
+{
+	memset(tr, 0, sizeof(*tr));
+	tr->tx_buf = (unsigned long)tx;
+	tr->rx_buf = (unsigned long)rx;
+	tr->len = len;
+	tr->delay_usecs = delay;
+	tr->speed_hz = dev->speed;
+	tr->bits_per_word = dev->bits;
 
-	prev_read_count = _read_count;
-	prev_write_count = _write_count;
+	if (dev->mode & SPI_TX_QUAD)
+		tr->tx_nbits = 4;
+	else if (dev->mode & SPI_TX_DUAL)
+		tr->tx_nbits = 2;
+	if (dev->mode & SPI_RX_QUAD)
+		tr->rx_nbits = 4;
+	else if (dev->mode & SPI_RX_DUAL)
+		tr->rx_nbits = 2;
+	if (!(dev->mode & SPI_LOOP)) {
+		if (dev->mode & (SPI_TX_QUAD | SPI_TX_DUAL))
+			tr->rx_buf = 0;
+		else if (dev->mode & (SPI_RX_QUAD | SPI_RX_DUAL))
+			tr->tx_buf = 0;
+	}
 }
 
-static void transfer_buf(int fd, int len)
-{
-	uint8_t *tx;
-	uint8_t *rx;
-	int i;
+/*
+ * --trace FILE: every message handed to a transport leaves a record in
+ * its device's ring: timing, size, result and the first --trace-bytes of
+ * TX and RX. The transfer thread only fills a slot and publishes it; a
+ * flusher thread drains the rings into the file in the background, see
+ * spidev_trace.h for the format. A full ring drops the record rather
+ * than stall the bus, and the drops are counted in the trace header.
+ */
+#define TRACE_RING	4096
 
-	tx = malloc(len);
-	if (!tx)
-		pabort("can't allocate tx buffer");
-	for (i = 0; i < len; i++)
-		tx[i] = random();
+struct trace_slot {
+	struct spi_trace_rec rec;
+	uint8_t data[2 * SPI_TRACE_SAMPLE_MAX];
+};
 
-	rx = malloc(len);
-	if (!rx)
-		pabort("can't allocate rx buffer");
+struct trace_ring {
+	atomic_uint head;
+	char pad[64 - sizeof(atomic_uint)];
+	atomic_uint tail;
+	uint64_t dropped;
+	struct trace_slot slots[TRACE_RING];
+};
 
-	transfer(fd, tx, rx, len);
+static uint64_t trace_t0;
 
-	_write_count += len;
-	_read_count += len;
+static void trace_sample_copy(uint8_t *dst, const struct spi_ioc_transfer *tr,
+			      int n, size_t sample, int rx)
+{
+	size_t off = 0, len;
+	unsigned long buf;
+	int i;
 
-	if (mode & SPI_LOOP) {
-		if (memcmp(tx, rx, len)) {
-			fprintf(stderr, "transfer error !\n");
-			hex_dump(tx, len, 32, "TX");
-			hex_dump(rx, len, 32, "RX");
-			exit(1);
-		}
+	for (i = 0; i < n && off < sample; i++) {
+		len = tr[i].len < sample - off ? tr[i].len : sample - off;
+		buf = rx ? tr[i].rx_buf : tr[i].tx_buf;
+		if (buf)
+			memcpy(dst + off, (void *)buf, len);
+		else
+			memset(dst + off, 0, len);
+		off += len;
 	}
-
-	free(rx);
-	free(tx);
 }
 
-int main(int argc, char *argv[])
+static void trace_record(struct spi_dev *dev, struct spi_ioc_transfer *tr,
+			 int n, uint64_t t0, uint64_t lat, int ret)
 {
-	int ret = 0;
-	int fd;
+	struct trace_ring *r = dev->trace;
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	struct spi_trace_rec *rec;
+	struct trace_slot *slot;
+	size_t total = 0;
+	int i;
 
-	parse_opts(argc, argv);
+	if (head - tail >= TRACE_RING) {
+		r->dropped++;
+		return;
+	}
+	slot = &r->slots[head % TRACE_RING];
+	rec = &slot->rec;
 
-	fd = open(device, O_RDWR);
-	if (fd < 0)
-		pabort("can't open device");
+	for (i = 0; i < n; i++)
+		total += tr[i].len;
+	rec->t_ns = t0 - trace_t0;
+	rec->dur_ns = lat < UINT32_MAX ? lat : UINT32_MAX;
+	rec->len = total;
+	rec->ret = ret < 0 ? -errno : ret;
+	rec->speed_hz = tr[0].speed_hz ? tr[0].speed_hz : dev->speed;
+	rec->dev = dev - devices;
+	rec->ntr = n < 255 ? n : 255;
+	rec->bits = tr[0].bits_per_word ? tr[0].bits_per_word : dev->bits;
+	rec->flags = (tr[n - 1].cs_change ? SPI_TRACE_CS_CHANGE : 0) |
+		     (ret < 0 ? SPI_TRACE_ERROR : 0);
+	rec->sample = total < trace_sample ? total : trace_sample;
+	trace_sample_copy(slot->data, tr, n, rec->sample, 0);
+	trace_sample_copy(slot->data + rec->sample, tr, n, rec->sample, 1);
 
-	/*
-	 * spi mode
-	 */
-	ret = ioctl(fd, SPI_IOC_WR_MODE32, &mode);
-	if (ret == -1)
-		pabort("can't set spi mode");
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
 
-	ret = ioctl(fd, SPI_IOC_RD_MODE32, &mode);
-	if (ret == -1)
-		pabort("can't get spi mode");
+static int spi_message_try(struct spi_dev *dev, struct spi_ioc_transfer *tr,
+			   int n)
+{
+	uint64_t t0, lat;
+	int ret;
 
-	/*
-	 * bits per word
-	 */
-	ret = ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
-	if (ret == -1)
-		pabort("can't set bits per word");
+	t0 = now_ns();
+	ret = dev->ops->message(dev, tr, n);
+	lat = now_ns() - t0;
+	if (dev->trace)
+		trace_record(dev, tr, n, t0, lat, ret);
+	if (ret < 1)
+		return ret;
+	dev->ioctl_count++;
+	hist_record(&dev->lat_total, lat);
+	hist_record(&dev->lat_interval, lat);
+	return ret;
+}
 
-	ret = ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits);
-	if (ret == -1)
-		pabort("can't get bits per word");
+/*
+ * spidev refuses messages carrying more than its bufsiz module parameter
+ * in total (4096 bytes unless changed). spi_submit() takes transfers of
+ * any length, cuts them into word aligned pieces and packs the pieces
+ * into as few bufsiz sized messages as possible. Inside a message chip
+ * select stays asserted between the pieces of one transfer; across
+ * message boundaries it only does so with --cs-hold, by setting
+ * cs_change on the last transfer of each message.
+ */
+static void read_bufsiz(void)
+{
+	unsigned long val;
+	FILE *f;
 
-	/*
-	 * max speed hz
-	 */
-	ret = ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
-	if (ret == -1)
-		pabort("can't set max speed hz");
+	if (spidev_bufsiz)
+		return;
+	spidev_bufsiz = 4096;
+	f = fopen("/sys/module/spidev/parameters/bufsiz", "r");
+	if (!f)
+		return;
+	if (fscanf(f, "%lu", &val) == 1 && val)
+		spidev_bufsiz = val;
+	fclose(f);
+}
 
-	ret = ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed);
-	if (ret == -1)
-		pabort("can't get max speed hz");
+static int spi_submit_try(struct spi_dev *dev, struct spi_ioc_transfer *tr,
+			  int n)
+{
+	struct spi_ioc_transfer msg[MAX_BATCH];
+	size_t word = dev->bits > 16 ? 4 : dev->bits > 8 ? 2 : 1;
+	size_t limit = spidev_bufsiz - spidev_bufsiz % word;
+	size_t total = 0, off, piece;
+	int done = 0, ret, i, m = 0;
 
-	printf("spi mode: 0x%x\n", mode);
-	printf("bits per word: %d\n", bits);
-	printf("max speed: %d Hz (%d KHz)\n", speed, speed/1000);
+	for (i = 0; i < n; i++)
+		total += tr[i].len;
+	if (total <= spidev_bufsiz)
+		return spi_message_try(dev, tr, n);
+	if (!limit)
+		return -1;
 
-	if (input_tx && input_file)
-		pabort("only one of -p and --input may be selected");
+	total = 0;
+	for (i = 0; i < n; i++) {
+		for (off = 0; off < tr[i].len; off += piece) {
+			piece = tr[i].len - off;
+			if (piece > limit - total)
+				piece = (limit - total) & ~(word - 1);
+			if (!piece || m == MAX_BATCH) {
+				/* message full: keep CS only if asked to */
+				msg[m - 1].cs_change = cs_hold &&
+						       !msg[m - 1].cs_change;
+				ret = spi_message_try(dev, msg, m);
+				if (ret < 1)
+					return ret;
+				done += ret;
+				m = 0;
+				total = 0;
+				piece = 0;
+				continue;
+			}
+			msg[m] = tr[i];
+			if (msg[m].tx_buf)
+				msg[m].tx_buf += off;
+			if (msg[m].rx_buf)
+				msg[m].rx_buf += off;
+			msg[m].len = piece;
+			if (off + piece < tr[i].len) {
+				msg[m].cs_change = 0;
+				msg[m].delay_usecs = 0;
+			}
+			total += piece;
+			m++;
+		}
+	}
+
+	ret = spi_message_try(dev, msg, m);
+	if (ret < 1)
+		return ret;
+	return done + ret;
+}
+
+static void spi_submit(struct spi_dev *dev, struct spi_ioc_transfer *tr, int n)
+{
+	if (spi_submit_try(dev, tr, n) < 1)
+		pabort("can't send spi message");
+}
+
+/*
+ * RX output sink. The file is opened once and every received buffer is
+ * appended to it; small writes are coalesced in a page aligned buffer and
+ * reach the file in out_buf_size pieces. With O_DIRECT only whole pages
+ * are written from the buffer until the final flush.
+ */
+struct out_sink {
+	int fd;
+	uint8_t *buf;
+	size_t len;
+	size_t align;
+};
+
+static struct out_sink out = { .fd = -1 };
+
+static void write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0)
+			pabort("not all bytes written to output file");
+		buf += ret;
+		len -= ret;
+	}
+}
+
+static void sink_open(struct out_sink *sink, const char *filename)
+{
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	void *buf;
+
+	if (out_direct)
+		flags |= O_DIRECT;
+
+	sink->fd = open(filename, flags, 0666);
+	if (sink->fd < 0)
+		pabort("could not open output file");
+
+	sink->align = sysconf(_SC_PAGESIZE);
+	out_buf_size = (out_buf_size + sink->align - 1) & ~(sink->align - 1);
+	if (posix_memalign(&buf, sink->align, out_buf_size))
+		pabort("can't allocate output buffer");
+	sink->buf = buf;
+	sink->len = 0;
+}
+
+static void sink_flush(struct out_sink *sink, int final)
+{
+	size_t len = sink->len;
+
+	if (out_direct && !final)
+		len &= ~(sink->align - 1);
+	if (!len)
+		return;
+
+	write_all(sink->fd, sink->buf, len);
+	if (out_sync && fdatasync(sink->fd))
+		pabort("can't sync output file");
+
+	sink->len -= len;
+	memmove(sink->buf, sink->buf + len, sink->len);
+}
+
+static void sink_write(struct out_sink *sink, const uint8_t *data, size_t len)
+{
+	size_t n;
+
+	/* big buffers go straight out unless O_DIRECT needs them aligned */
+	if (!out_direct && len >= out_buf_size) {
+		sink_flush(sink, 1);
+		write_all(sink->fd, data, len);
+		return;
+	}
+
+	while (len) {
+		n = out_buf_size - sink->len;
+		if (n > len)
+			n = len;
+		memcpy(sink->buf + sink->len, data, n);
+		sink->len += n;
+		data += n;
+		len -= n;
+		if (sink->len == out_buf_size)
+			sink_flush(sink, 0);
+	}
+}
+
+static void sink_close(struct out_sink *sink)
+{
+	/* the unaligned tail can't go out with O_DIRECT set */
+	if (out_direct && (sink->len & (sink->align - 1)))
+		fcntl(sink->fd, F_SETFL,
+		      fcntl(sink->fd, F_GETFL) & ~O_DIRECT);
+	sink_flush(sink, 1);
+	if ((out_sync || out_direct) && fdatasync(sink->fd))
+		pabort("can't sync output file");
+	close(sink->fd);
+	free(sink->buf);
+	sink->fd = -1;
+}
+
+/*
+ * Trace file writer. It wakes up every millisecond, which at 4096 slots
+ * per ring keeps up with a few million messages a second.
+ */
+static struct {
+	int fd;
+	pthread_t thread;
+	atomic_int done;
+	uint64_t records;
+	uint8_t buf[1 << 16];
+	size_t len;
+} trace;
+
+static void trace_drain(void)
+{
+	struct trace_ring *r;
+	struct trace_slot *slot;
+	unsigned int head, tail;
+	size_t size;
+	int d;
+
+	for (d = 0; d < num_devices; d++) {
+		r = devices[d].trace;
+		tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		head = atomic_load_explicit(&r->head, memory_order_acquire);
+		for (; tail != head; tail++) {
+			slot = &r->slots[tail % TRACE_RING];
+			size = sizeof(slot->rec) + 2 * slot->rec.sample;
+			if (trace.len + size > sizeof(trace.buf)) {
+				write_all(trace.fd, trace.buf, trace.len);
+				trace.len = 0;
+			}
+			memcpy(trace.buf + trace.len, slot, size);
+			trace.len += size;
+			trace.records++;
+			atomic_store_explicit(&r->tail, tail + 1,
+					      memory_order_release);
+		}
+	}
+	write_all(trace.fd, trace.buf, trace.len);
+	trace.len = 0;
+}
+
+static void *trace_flusher(void *arg)
+{
+	struct timespec ts = { 0, 1000000 };
+
+	(void)arg;
+	while (!atomic_load(&trace.done)) {
+		trace_drain();
+		nanosleep(&ts, NULL);
+	}
+	trace_drain();
+	return NULL;
+}
+
+static void trace_open(const char *filename)
+{
+	struct spi_trace_hdr hdr;
+	int d;
+
+	trace.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (trace.fd < 0)
+		pabort("can't open trace file");
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SPI_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = SPI_TRACE_VERSION;
+	hdr.byte_order = SPI_TRACE_BYTE_ORDER;
+	hdr.ndev = num_devices;
+	hdr.sample = trace_sample;
+	write_all(trace.fd, (uint8_t *)&hdr, sizeof(hdr));
+	for (d = 0; d < num_devices; d++)
+		write_all(trace.fd, (uint8_t *)devices[d].path,
+			  strlen(devices[d].path) + 1);
+
+	for (d = 0; d < num_devices; d++) {
+		devices[d].trace = calloc(1, sizeof(*devices[d].trace));
+		if (!devices[d].trace)
+			pabort("can't allocate trace ring");
+	}
+
+	trace_t0 = now_ns();
+	atomic_init(&trace.done, 0);
+	if (pthread_create(&trace.thread, NULL, trace_flusher, NULL))
+		pabort("can't start trace writer");
+}
+
+static void trace_close(void)
+{
+	struct spi_trace_hdr hdr;
+	uint64_t dropped = 0;
+	int d;
+
+	atomic_store(&trace.done, 1);
+	pthread_join(trace.thread, NULL);
+
+	for (d = 0; d < num_devices; d++) {
+		dropped += devices[d].trace->dropped;
+		free(devices[d].trace);
+		devices[d].trace = NULL;
+	}
+
+	/* counts go into the header when the file allows it */
+	if (pread(trace.fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) {
+		hdr.records = trace.records;
+		hdr.dropped = dropped;
+		if (pwrite(trace.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			fprintf(stderr, "can't update trace header\n");
+	}
+	close(trace.fd);
+
+	fprintf(stderr, "trace: %llu messages, %llu dropped\n",
+		(unsigned long long)trace.records,
+		(unsigned long long)dropped);
+}
+
+/*
+ * Send @n back to back segments of @len bytes each as one message, so the
+ * whole batch costs a single syscall. Segments live contiguously in @tx/@rx.
+ */
+static void setup_batch(struct spi_dev *dev, struct spi_ioc_transfer *tr,
+			uint8_t const *tx, uint8_t const *rx, size_t len, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		setup_transfer(dev, &tr[i], tx + i * len, rx + i * len, len);
+		if (i < n - 1) {
+			tr[i].cs_change = cs_change;
+			tr[i].delay_usecs = seg_delay;
+		}
+	}
+}
+
+static void transfer_batch(struct spi_dev *dev, uint8_t const *tx,
+			   uint8_t const *rx, size_t len, int n)
+{
+	struct spi_ioc_transfer tr[MAX_BATCH];
+
+	setup_batch(dev, tr, tx, rx, len, n);
+	spi_submit(dev, tr, n);
+
+	len *= n;
+
+	if (verbose)
+		hex_dump(tx, len, 32, "TX");
+
+	if (output_file)
+		sink_write(&out, rx, len);
+
+	if (verbose)
+		hex_dump(rx, len, 32, "RX");
+}
+
+static void transfer(struct spi_dev *dev, uint8_t const *tx, uint8_t const *rx,
+		     size_t len)
+{
+	transfer_batch(dev, tx, rx, len, 1);
+}
+
+/*
+ * TX pattern generators. All of them produce the data a machine word at a
+ * time where the sequence allows it, so filling a buffer stays cheap next to
+ * the bus time even for large transfers. The state carries over between
+ * calls, so consecutive buffers continue one sequence.
+ */
+enum {
+	PATTERN_XORSHIFT,
+	PATTERN_COUNTER,
+	PATTERN_PRBS7,
+	PATTERN_PRBS15,
+	PATTERN_PRBS31,
+	PATTERN_ZEROS,
+	PATTERN_ONES,
+};
+
+static const char * const pattern_names[] = {
+	[PATTERN_XORSHIFT] = "xorshift",
+	[PATTERN_COUNTER]  = "counter",
+	[PATTERN_PRBS7]    = "prbs7",
+	[PATTERN_PRBS15]   = "prbs15",
+	[PATTERN_PRBS31]   = "prbs31",
+	[PATTERN_ZEROS]    = "zeros",
+	[PATTERN_ONES]     = "ones",
+};
+
+static int pattern = PATTERN_XORSHIFT;
+
+struct pattern_gen {
+	int type;
+	uint64_t state;
+};
+
+static int pattern_parse(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(pattern_names); i++)
+		if (!strcmp(name, pattern_names[i]))
+			return i;
+	return -1;
+}
+
+/* PRBS-n polynomials x^n + x^m + 1 (ITU-T O.150) */
+static const struct {
+	int n, m;
+} prbs_poly[] = {
+	[PATTERN_PRBS7]  = {  7,  6 },
+	[PATTERN_PRBS15] = { 15, 14 },
+	[PATTERN_PRBS31] = { 31, 28 },
+};
+
+static void pattern_init(struct pattern_gen *gen, int type, uint64_t seed)
+{
+	gen->type = type;
+	gen->state = seed;
+
+	switch (type) {
+	case PATTERN_XORSHIFT:
+		if (!gen->state)
+			gen->state = 0x9e3779b97f4a7c15ULL;
+		break;
+	case PATTERN_PRBS7:
+	case PATTERN_PRBS15:
+	case PATTERN_PRBS31:
+		gen->state &= (1ULL << prbs_poly[type].n) - 1;
+		if (!gen->state)
+			gen->state = (1ULL << prbs_poly[type].n) - 1;
+		break;
+	}
+}
+
+static inline uint64_t xorshift64s(uint64_t *s)
+{
+	uint64_t x = *s;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*s = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * Advance a Fibonacci LFSR by @k bits at once. All k feedback bits only
+ * depend on state bits that already exist as long as k <= m, so a whole
+ * group is computed with two shifts and one xor. Output is MSB first.
+ */
+static inline uint32_t prbs_step(uint64_t *s, int n, int m, int k)
+{
+	uint64_t out = ((*s >> (n - k)) ^ (*s >> (m - k))) & ((1u << k) - 1);
+
+	*s = ((*s << k) | out) & ((1ULL << n) - 1);
+	return out;
+}
+
+static void pattern_fill(struct pattern_gen *gen, uint8_t *buf, size_t len)
+{
+	size_t i = 0;
+	uint64_t w;
+	int n, m;
+
+	switch (gen->type) {
+	case PATTERN_XORSHIFT:
+		for (; i + 8 <= len; i += 8) {
+			w = xorshift64s(&gen->state);
+			memcpy(buf + i, &w, 8);
+		}
+		if (i < len) {
+			w = xorshift64s(&gen->state);
+			memcpy(buf + i, &w, len - i);
+		}
+		break;
+	case PATTERN_COUNTER:
+		for (; i < len; i++)
+			buf[i] = (uint8_t)(gen->state + i);
+		gen->state += len;
+		break;
+	case PATTERN_PRBS7:
+		/* m = 6 is too short for a whole byte per step */
+		for (; i < len; i++)
+			buf[i] = prbs_step(&gen->state, 7, 6, 4) << 4 |
+				 prbs_step(&gen->state, 7, 6, 4);
+		break;
+	case PATTERN_PRBS15:
+	case PATTERN_PRBS31:
+		n = prbs_poly[gen->type].n;
+		m = prbs_poly[gen->type].m;
+		for (; i < len; i++)
+			buf[i] = prbs_step(&gen->state, n, m, 8);
+		break;
+	case PATTERN_ZEROS:
+		memset(buf, 0x00, len);
+		break;
+	case PATTERN_ONES:
+		memset(buf, 0xff, len);
+		break;
+	}
+}
+
+/*
+ * Transfer buffers are allocated once, page aligned and pre-faulted, and
+ * reused for every iteration so the loop measures the bus, not malloc.
+ */
+struct buf_pool {
+	uint8_t *tx;
+	uint8_t *rx;
+	size_t size;
+};
+
+static uint8_t *pool_alloc_buf(size_t size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	void *buf;
+
+	if (posix_memalign(&buf, page, size))
+		pabort("can't allocate transfer buffer");
+	memset(buf, 0, size);
+
+	if (lock_buffers && mlock(buf, size))
+		pabort("can't lock transfer buffer");
+
+	return buf;
+}
+
+static void pool_init(struct buf_pool *pool, size_t size)
+{
+	pool->size = size;
+	pool->tx = pool_alloc_buf(size);
+	pool->rx = pool_alloc_buf(size);
+}
+
+static void pool_free(struct buf_pool *pool)
+{
+	if (lock_buffers) {
+		munlock(pool->tx, pool->size);
+		munlock(pool->rx, pool->size);
+	}
+	free(pool->rx);
+	free(pool->tx);
+}
+
+/*
+ * Kernel spidev transport.
+ */
+static int spidev_open(struct spi_dev *dev)
+{
+	dev->fd = open(dev->path, O_RDWR);
+	return dev->fd;
+}
+
+static const char *spidev_setup(struct spi_dev *dev)
+{
+	int ret;
+
+	/*
+	 * spi mode
+	 */
+	ret = ioctl(dev->fd, SPI_IOC_WR_MODE32, &dev->mode);
+	if (ret == -1)
+		return "can't set spi mode";
+
+	ret = ioctl(dev->fd, SPI_IOC_RD_MODE32, &dev->mode);
+	if (ret == -1)
+		return "can't get spi mode";
+
+	/*
+	 * bits per word
+	 */
+	ret = ioctl(dev->fd, SPI_IOC_WR_BITS_PER_WORD, &dev->bits);
+	if (ret == -1)
+		return "can't set bits per word";
+
+	ret = ioctl(dev->fd, SPI_IOC_RD_BITS_PER_WORD, &dev->bits);
+	if (ret == -1)
+		return "can't get bits per word";
+
+	/*
+	 * max speed hz
+	 */
+	ret = ioctl(dev->fd, SPI_IOC_WR_MAX_SPEED_HZ, &dev->speed);
+	if (ret == -1)
+		return "can't set max speed hz";
+
+	ret = ioctl(dev->fd, SPI_IOC_RD_MAX_SPEED_HZ, &dev->speed);
+	if (ret == -1)
+		return "can't get max speed hz";
+
+	return NULL;
+}
+
+static int spidev_message(struct spi_dev *dev, struct spi_ioc_transfer *tr,
+			  int n)
+{
+	return ioctl(dev->fd, SPI_IOC_MESSAGE(n), tr);
+}
+
+static void spidev_close(struct spi_dev *dev)
+{
+	close(dev->fd);
+}
+
+/*
+ * In-process emulator: MISO is wired to MOSI, so it behaves like spidev
+ * in loopback. Each message takes as long as the real bus would (bits /
+ * speed_hz, plus delay_usecs and a fixed --emu-latency per message), it
+ * enforces bufsiz like spidev does, and --emu-ber flips received bits at
+ * the given rate. The bit error gaps are drawn from an exponential
+ * distribution, so the cost is per error rather than per bit.
+ */
+struct emu_state {
+	uint64_t rng;
+	uint64_t next_err;	/* bits until the next injected error */
+};
+
+static uint64_t emu_gap(struct emu_state *st)
+{
+	double u = ((xorshift64s(&st->rng) >> 11) + 1) * 0x1p-53;
+	double gap = -log(u) / emu_ber;
+
+	/*
+	 * A tiny rate gives gaps past what uint64_t holds; 2^62 bits is no
+	 * error for the whole run, and next_err + 1 + gap cannot wrap.
+	 */
+	if (gap >= 0x1p62)
+		return 1ULL << 62;
+	return gap;
+}
+
+static int emu_open(struct spi_dev *dev)
+{
+	struct emu_state *st;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return -1;
+	st->rng = 0x853c49e6748fea9bULL ^ (uint64_t)(dev - devices);
+	if (emu_ber > 0)
+		st->next_err = emu_gap(st);
+	dev->priv = st;
+	dev->fd = -1;
+	return 0;
+}
+
+static const char *emu_setup(struct spi_dev *dev)
+{
+	errno = EINVAL;
+	if (!dev->bits || dev->bits > 32)
+		return "can't set bits per word";
+	if (!dev->speed)
+		return "can't set max speed hz";
+	return NULL;
+}
+
+/* sleep for the bulk of a wait and spin the rest, for sub-us accuracy */
+static void emu_wait_until(uint64_t deadline)
+{
+	struct timespec ts;
+	uint64_t now = now_ns();
+
+	if (deadline > now + 100000) {
+		ts.tv_sec = (deadline - now - 50000) / 1000000000ULL;
+		ts.tv_nsec = (deadline - now - 50000) % 1000000000ULL;
+		nanosleep(&ts, NULL);
+	}
+	while (now_ns() < deadline)
+		;
+}
+
+static uint64_t emu_bus_ns(struct spi_dev *dev, struct spi_ioc_transfer *tr,
+			   int n, size_t *total)
+{
+	uint64_t ns = emu_latency * 1000ULL;
+	uint32_t hz;
+	int i;
+
+	*total = 0;
+	for (i = 0; i < n; i++) {
+		hz = tr[i].speed_hz ? tr[i].speed_hz : dev->speed;
+		ns += tr[i].len * 8000000000ULL / hz;
+		ns += tr[i].delay_usecs * 1000ULL;
+		*total += tr[i].len;
+	}
+	return ns;
+}
+
+static int emu_message(struct spi_dev *dev, struct spi_ioc_transfer *tr, int n)
+{
+	struct emu_state *st = dev->priv;
+	uint64_t deadline = now_ns();
+	size_t total;
+	uint8_t *rx;
+	uint64_t bits;
+	int i;
+
+	deadline += emu_bus_ns(dev, tr, n, &total);
+	if (total > spidev_bufsiz) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		rx = (uint8_t *)(unsigned long)tr[i].rx_buf;
+		if (!rx)
+			continue;
+		if (tr[i].tx_buf)
+			memmove(rx, (void *)(unsigned long)tr[i].tx_buf,
+				tr[i].len);
+		else
+			memset(rx, 0, tr[i].len);
+
+		if (emu_ber <= 0)
+			continue;
+		bits = tr[i].len * 8ULL;
+		while (st->next_err < bits) {
+			rx[st->next_err / 8] ^= 1 << (st->next_err & 7);
+			st->next_err += 1 + emu_gap(st);
+		}
+		st->next_err -= bits;
+	}
+
+	emu_wait_until(deadline);
+	return total;
+}
+
+static void emu_close(struct spi_dev *dev)
+{
+	free(dev->priv);
+}
+
+/*
+ * Scripted peripheral model, for protocol tests. The --model file has
+ * one rule per line, a TX prefix and the bytes the peripheral answers
+ * with once it has seen that prefix:
+ *
+ *	# JEDEC ID of a W25Q64
+ *	9f	ef4017
+ *	# status register, polled forever
+ *	05	00	repeat
+ *	default	ff
+ *
+ * A transaction runs until a transfer with cs_change set, or the end of
+ * the message. Its first bytes are matched against the prefixes, the
+ * longest match wins, and the reply is clocked out right after the
+ * prefix; every other byte reads as the default (0xff, an idle MISO).
+ * The model uses the emulator's timing model.
+ */
+#define MODEL_MAX_CMD 16
+
+struct model_rule {
+	uint8_t cmd[MODEL_MAX_CMD];
+	size_t cmd_len;
+	uint8_t *reply;
+	size_t reply_len;
+	int repeat;
+};
+
+static struct model_rule *model_rules;
+static int model_nrules;
+static uint8_t model_default = 0xff;
+
+static size_t parse_hex(const char *str, uint8_t *buf, size_t max)
+{
+	size_t n = 0;
+	unsigned int ch;
+
+	while (str[0] && str[1] && n < max) {
+		if (!isxdigit(str[0]) || !isxdigit(str[1]) ||
+		    sscanf(str, "%2x", &ch) != 1)
+			return 0;
+		buf[n++] = ch;
+		str += 2;
+	}
+	return *str ? 0 : n;
+}
+
+static void model_load(const char *filename)
+{
+	char line[1024], *tok[3], *cur;
+	struct model_rule *r;
+	uint8_t reply[512];
+	int lineno = 0, n;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+		pabort("can't open model file");
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		cur = strchr(line, '#');
+		if (cur)
+			*cur = 0;
+		cur = line;
+		for (n = 0; n < 3; n++) {
+			while (isspace(*cur))
+				cur++;
+			tok[n] = *cur ? cur : NULL;
+			while (*cur && !isspace(*cur))
+				cur++;
+			if (*cur)
+				*cur++ = 0;
+		}
+		if (!tok[0])
+			continue;
+		if (!tok[1])
+			goto bad;
+
+		if (!strcmp(tok[0], "default")) {
+			if (parse_hex(tok[1], &model_default, 1) != 1)
+				goto bad;
+			continue;
+		}
+
+		model_rules = realloc(model_rules,
+				      (model_nrules + 1) * sizeof(*model_rules));
+		if (!model_rules)
+			pabort("can't allocate model");
+		r = &model_rules[model_nrules++];
+		memset(r, 0, sizeof(*r));
+		r->cmd_len = parse_hex(tok[0], r->cmd, sizeof(r->cmd));
+		r->reply_len = parse_hex(tok[1], reply, sizeof(reply));
+		if (!r->cmd_len || !r->reply_len)
+			goto bad;
+		r->reply = malloc(r->reply_len);
+		if (!r->reply)
+			pabort("can't allocate model");
+		memcpy(r->reply, reply, r->reply_len);
+		if (tok[2]) {
+			if (strcmp(tok[2], "repeat"))
+				goto bad;
+			r->repeat = 1;
+		}
+	}
+	fclose(f);
+	return;
+bad:
+	fprintf(stderr, "%s:%d: expected \"<hex prefix> <hex reply> "
+		"[repeat]\" or \"default <hex byte>\"\n", filename, lineno);
+	exit(1);
+}
+
+static uint8_t model_byte(const struct model_rule *r, size_t pos)
+{
+	if (!r || pos < r->cmd_len)
+		return model_default;
+	pos -= r->cmd_len;
+	if (pos < r->reply_len)
+		return r->reply[pos];
+	if (r->repeat)
+		return r->reply[pos % r->reply_len];
+	return model_default;
+}
+
+static void model_transaction(struct spi_ioc_transfer *tr, int n)
+{
+	const struct model_rule *rule = NULL;
+	uint8_t cmd[MODEL_MAX_CMD];
+	size_t have = 0, pos = 0, len, j;
+	const uint8_t *tx;
+	uint8_t *rx;
+	int i;
+
+	for (i = 0; i < n && have < sizeof(cmd); i++) {
+		len = tr[i].len < sizeof(cmd) - have ?
+		      tr[i].len : sizeof(cmd) - have;
+		tx = (const uint8_t *)(unsigned long)tr[i].tx_buf;
+		if (tx)
+			memcpy(cmd + have, tx, len);
+		else
+			memset(cmd + have, 0, len);
+		have += len;
+	}
+
+	for (i = 0; i < model_nrules; i++)
+		if (model_rules[i].cmd_len <= have &&
+		    !memcmp(model_rules[i].cmd, cmd, model_rules[i].cmd_len) &&
+		    (!rule || model_rules[i].cmd_len > rule->cmd_len))
+			rule = &model_rules[i];
+
+	for (i = 0; i < n; i++) {
+		rx = (uint8_t *)(unsigned long)tr[i].rx_buf;
+		if (rx)
+			for (j = 0; j < tr[i].len; j++)
+				rx[j] = model_byte(rule, pos + j);
+		pos += tr[i].len;
+	}
+}
+
+static int model_message(struct spi_dev *dev, struct spi_ioc_transfer *tr,
+			 int n)
+{
+	uint64_t deadline = now_ns();
+	size_t total;
+	int first = 0, i;
+
+	deadline += emu_bus_ns(dev, tr, n, &total);
+	if (total > spidev_bufsiz) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (i == n - 1 || tr[i].cs_change) {
+			model_transaction(tr + first, i - first + 1);
+			first = i + 1;
+		}
+	}
+
+	emu_wait_until(deadline);
+	return total;
+}
+
+/*
+ * SD card in SPI mode, as much of it as --sd needs: CMD0, 8, 55/ACMD41,
+ * 58, 16, 59, single and multi block reads (17, 18, 12) and writes (24,
+ * 25) on a RAM backed SDHC card of SDEMU_BLOCKS blocks. Commands must
+ * carry a valid CRC7 and written blocks a valid CRC16, so the host side
+ * of the protocol gets checked too. The card sees one MOSI byte at a
+ * time and answers with one MISO byte; it is deselected after a transfer
+ * with cs_change set, or at the end of a message without.
+ */
+#define SD_BLOCK	512
+#define SDEMU_BLOCKS	65536
+#define SDEMU_BUSY	4	/* bytes the card stays busy after a write */
+
+static uint16_t crc16_table[256];
+
+static uint8_t sd_crc7(const uint8_t *buf, size_t len)
+{
+	uint8_t crc = 0;
+	size_t i;
+	int b;
+
+	for (i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (b = 0; b < 8; b++)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x12 : crc << 1;
+	}
+	return crc >> 1;
+}
+
+/* CRC-16/XMODEM of the data tokens, a byte at a time from a table */
+static uint16_t sd_crc16(const uint8_t *buf, size_t len)
+{
+	uint16_t crc;
+	size_t i;
+	int b;
+
+	if (!crc16_table[1]) {
+		for (i = 0; i < 256; i++) {
+			crc = i << 8;
+			for (b = 0; b < 8; b++)
+				crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 :
+						     crc << 1;
+			crc16_table[i] = crc;
+		}
+	}
+
+	crc = 0;
+	for (i = 0; i < len; i++)
+		crc = crc << 8 ^ crc16_table[(crc >> 8 ^ buf[i]) & 0xff];
+	return crc;
+}
+
+enum {
+	SDEMU_CMD,
+	SDEMU_READ_MULTI,
+	SDEMU_WRITE_TOKEN,
+	SDEMU_WRITE_DATA,
+};
+
+struct sdemu {
+	uint8_t *mem;
+	uint8_t cmd[6];
+	int cmd_len;
+	uint8_t out[SD_BLOCK + 16];	/* queued MISO bytes */
+	int out_len, out_pos;
+	int state;
+	int multi;		/* the write is a CMD25 */
+	int app;		/* the last command was CMD55 */
+	int idle;
+	int init_polls;
+	uint32_t addr;
+	uint8_t blk[SD_BLOCK + 2];
+	int blk_len;
+};
+
+static void sdemu_put(struct sdemu *c, uint8_t b)
+{
+	if (c->out_len < (int)sizeof(c->out))
+		c->out[c->out_len++] = b;
+}
+
+static void sdemu_busy(struct sdemu *c)
+{
+	int i;
+
+	for (i = 0; i < SDEMU_BUSY; i++)
+		sdemu_put(c, 0x00);
+}
+
+static void sdemu_queue_block(struct sdemu *c)
+{
+	uint8_t *data = c->mem + (size_t)c->addr * SD_BLOCK;
+	uint16_t crc = sd_crc16(data, SD_BLOCK);
+
+	sdemu_put(c, 0xff);
+	sdemu_put(c, 0xfe);
+	memcpy(c->out + c->out_len, data, SD_BLOCK);
+	c->out_len += SD_BLOCK;
+	sdemu_put(c, crc >> 8);
+	sdemu_put(c, crc);
+}
+
+static void sdemu_command(struct sdemu *c)
+{
+	uint32_t arg = (uint32_t)c->cmd[1] << 24 | c->cmd[2] << 16 |
+		       c->cmd[3] << 8 | c->cmd[4];
+	int cmd = c->cmd[0] & 0x3f;
+	int app = c->app;
+
+	c->out_len = c->out_pos = 0;
+	c->state = SDEMU_CMD;
+	c->app = 0;
+	sdemu_put(c, 0xff);		/* NCR */
+
+	if ((sd_crc7(c->cmd, 5) << 1 | 1) != c->cmd[5]) {
+		sdemu_put(c, c->idle | 0x08);
+		return;
+	}
+
+	switch (cmd) {
+	case 0:
+		c->idle = 1;
+		c->init_polls = 0;
+		sdemu_put(c, 0x01);
+		break;
+	case 8:
+		sdemu_put(c, c->idle);
+		sdemu_put(c, 0x00);
+		sdemu_put(c, 0x00);
+		sdemu_put(c, (arg >> 8) & 0x0f);
+		sdemu_put(c, arg);
+		break;
+	case 55:
+		c->app = 1;
+		sdemu_put(c, c->idle);
+		break;
+	case 41:
+		if (!app) {
+			sdemu_put(c, c->idle | 0x04);
+			break;
+		}
+		/* takes a few polls, like a real card */
+		if (++c->init_polls > 2)
+			c->idle = 0;
+		sdemu_put(c, c->idle);
+		break;
+	case 58:
+		sdemu_put(c, c->idle);
+		sdemu_put(c, c->idle ? 0x40 : 0xc0);	/* busy done, CCS */
+		sdemu_put(c, 0xff);
+		sdemu_put(c, 0x80);
+		sdemu_put(c, 0x00);
+		break;
+	case 12:
+		sdemu_put(c, c->idle);
+		sdemu_busy(c);
+		break;
+	case 16:
+	case 59:
+		sdemu_put(c, c->idle);
+		break;
+	case 17:
+	case 18:
+	case 24:
+	case 25:
+		if (c->idle) {
+			sdemu_put(c, c->idle | 0x04);
+			break;
+		}
+		if (arg >= SDEMU_BLOCKS) {
+			sdemu_put(c, 0x40);
+			break;
+		}
+		sdemu_put(c, 0x00);
+		c->addr = arg;
+		if (cmd == 17 || cmd == 18) {
+			sdemu_queue_block(c);
+			if (cmd == 18)
+				c->state = SDEMU_READ_MULTI;
+		} else {
+			c->multi = cmd == 25;
+			c->state = SDEMU_WRITE_TOKEN;
+		}
+		break;
+	default:
+		sdemu_put(c, c->idle | 0x04);
+		break;
+	}
+}
+
+static void sdemu_write_block(struct sdemu *c)
+{
+	uint16_t crc = c->blk[SD_BLOCK] << 8 | c->blk[SD_BLOCK + 1];
+
+	if (sd_crc16(c->blk, SD_BLOCK) != crc) {
+		sdemu_put(c, 0x0b);
+		c->state = SDEMU_CMD;
+	} else {
+		memcpy(c->mem + (size_t)c->addr * SD_BLOCK, c->blk, SD_BLOCK);
+		sdemu_put(c, 0x05);
+		c->addr++;
+		c->state = c->multi && c->addr < SDEMU_BLOCKS ?
+			   SDEMU_WRITE_TOKEN : SDEMU_CMD;
+	}
+	sdemu_busy(c);
+}
+
+static uint8_t sdemu_byte(struct sdemu *c, uint8_t mosi)
+{
+	uint8_t miso = 0xff;
+
+	if (c->out_pos < c->out_len)
+		miso = c->out[c->out_pos++];
+	if (c->out_pos == c->out_len) {
+		c->out_pos = c->out_len = 0;
+		if (c->state == SDEMU_READ_MULTI && ++c->addr < SDEMU_BLOCKS)
+			sdemu_queue_block(c);
+	}
+
+	switch (c->state) {
+	case SDEMU_WRITE_TOKEN:
+		if (mosi == (c->multi ? 0xfc : 0xfe)) {
+			c->state = SDEMU_WRITE_DATA;
+			c->blk_len = 0;
+		} else if (c->multi && mosi == 0xfd) {
+			c->state = SDEMU_CMD;
+			sdemu_put(c, 0xff);
+			sdemu_busy(c);
+		}
+		break;
+	case SDEMU_WRITE_DATA:
+		c->blk[c->blk_len++] = mosi;
+		if (c->blk_len == SD_BLOCK + 2)
+			sdemu_write_block(c);
+		break;
+	default:
+		if (!c->cmd_len && (mosi & 0xc0) != 0x40)
+			break;
+		c->cmd[c->cmd_len++] = mosi;
+		if (c->cmd_len == 6) {
+			c->cmd_len = 0;
+			sdemu_command(c);
+		}
+		break;
+	}
+	return miso;
+}
+
+static void sdemu_deselect(struct sdemu *c)
+{
+	c->cmd_len = 0;
+	c->out_len = c->out_pos = 0;
+	if (c->state == SDEMU_READ_MULTI)
+		c->state = SDEMU_CMD;
+}
+
+static int sdemu_open(struct spi_dev *dev)
+{
+	struct sdemu *c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -1;
+	c->mem = calloc(SDEMU_BLOCKS, SD_BLOCK);
+	if (!c->mem) {
+		free(c);
+		return -1;
+	}
+	c->idle = 1;
+	dev->priv = c;
+	dev->fd = -1;
+	return 0;
+}
+
+static int sdemu_message(struct spi_dev *dev, struct spi_ioc_transfer *tr,
+			 int n)
+{
+	struct sdemu *c = dev->priv;
+	uint64_t deadline = now_ns();
+	const uint8_t *tx;
+	uint8_t *rx, miso;
+	size_t total, j;
+	int i;
+
+	deadline += emu_bus_ns(dev, tr, n, &total);
+	if (total > spidev_bufsiz) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		tx = (const uint8_t *)(unsigned long)tr[i].tx_buf;
+		rx = (uint8_t *)(unsigned long)tr[i].rx_buf;
+		for (j = 0; j < tr[i].len; j++) {
+			miso = sdemu_byte(c, tx ? tx[j] : 0);
+			if (rx)
+				rx[j] = miso;
+		}
+		/* cs_change deselects, except on the last transfer */
+		if (!tr[i].cs_change == (i == n - 1))
+			sdemu_deselect(c);
+	}
+
+	emu_wait_until(deadline);
+	return total;
+}
+
+static void sdemu_close(struct spi_dev *dev)
+{
+	struct sdemu *c = dev->priv;
+
+	free(c->mem);
+	free(c);
+}
+
+/*
+ * BCM2835 SPI0 driven from user space: the controller's registers are
+ * mapped from /dev/mem and every message is clocked out by polling the
+ * FIFO, with no syscall at all. The kernel must not be using SPI0 at the
+ * same time (unbind spidev or skip the overlay), and the pins have to be
+ * in ALT0 already. The chip select is the last digit of the device path,
+ * so -D /dev/spidev0.1 means CE1 on either transport. SPI0 only does 8
+ * bit words; its clock is the core clock divided by an even number.
+ *
+ * All register access goes through a pair of accessors, so mmio-sim can
+ * put a register file with FIFOs behind them instead of the hardware.
+ * The simulated controller shifts instantly and wires MISO to MOSI.
+ */
+#define SPI0_OFFSET	0x204000
+#define SPI0_CORE_HZ	250000000
+#define SPI0_FIFO_SIZE	64
+
+#define SPI0_CS		0x00
+#define SPI0_FIFO	0x04
+#define SPI0_CLK	0x08
+#define SPI0_DLEN	0x0c
+
+#define SPI0_CS_CS	0x00000003
+#define SPI0_CS_CPHA	0x00000004
+#define SPI0_CS_CPOL	0x00000008
+#define SPI0_CS_CLEAR	0x00000030
+#define SPI0_CS_CSPOL	0x00000040
+#define SPI0_CS_TA	0x00000080
+#define SPI0_CS_DONE	0x00010000
+#define SPI0_CS_RXD	0x00020000
+#define SPI0_CS_TXD	0x00040000
+#define SPI0_CS_RXR	0x00080000
+#define SPI0_CS_RXF	0x00100000
+#define SPI0_CS_CSPOL0	0x00200000	/* CSPOL1, CSPOL2 follow */
+
+struct spi0_sim {
+	uint32_t cs, clk, dlen;
+	uint8_t tx[SPI0_FIFO_SIZE], rx[SPI0_FIFO_SIZE];
+	unsigned int tx_head, tx_tail, rx_head, rx_tail;
+};
+
+struct spi0 {
+	uint32_t (*read)(struct spi0 *s, unsigned int reg);
+	void (*write)(struct spi0 *s, unsigned int reg, uint32_t val);
+	volatile uint32_t *regs;
+	void *map;
+	struct spi0_sim *sim;
+	uint32_t cs;		/* CS register settings, TA clear */
+	uint32_t hz;		/* clock the divider is set up for */
+};
+
+static uint32_t spi0_mmio_read(struct spi0 *s, unsigned int reg)
+{
+	return s->regs[reg / 4];
+}
+
+static void spi0_mmio_write(struct spi0 *s, unsigned int reg, uint32_t val)
+{
+	s->regs[reg / 4] = val;
+}
+
+/* move bytes from TX to RX FIFO while there is room: an instant bus */
+static void spi0_sim_shift(struct spi0_sim *sim)
+{
+	if (!(sim->cs & SPI0_CS_TA))
+		return;
+	while (sim->tx_head != sim->tx_tail &&
+	       sim->rx_head - sim->rx_tail < SPI0_FIFO_SIZE)
+		sim->rx[sim->rx_head++ % SPI0_FIFO_SIZE] =
+			sim->tx[sim->tx_tail++ % SPI0_FIFO_SIZE];
+}
+
+static uint32_t spi0_sim_read(struct spi0 *s, unsigned int reg)
+{
+	struct spi0_sim *sim = s->sim;
+	unsigned int rx = sim->rx_head - sim->rx_tail;
+	unsigned int tx = sim->tx_head - sim->tx_tail;
+	uint32_t val;
+
+	switch (reg) {
+	case SPI0_CS:
+		val = sim->cs;
+		if (tx < SPI0_FIFO_SIZE)
+			val |= SPI0_CS_TXD;
+		if (rx)
+			val |= SPI0_CS_RXD;
+		if (rx >= SPI0_FIFO_SIZE * 3 / 4)
+			val |= SPI0_CS_RXR;
+		if (rx == SPI0_FIFO_SIZE)
+			val |= SPI0_CS_RXF;
+		if ((sim->cs & SPI0_CS_TA) && !tx)
+			val |= SPI0_CS_DONE;
+		return val;
+	case SPI0_FIFO:
+		if (!rx)
+			return 0;
+		val = sim->rx[sim->rx_tail++ % SPI0_FIFO_SIZE];
+		spi0_sim_shift(sim);
+		return val;
+	case SPI0_CLK:
+		return sim->clk;
+	case SPI0_DLEN:
+		return sim->dlen;
+	}
+	return 0;
+}
+
+static void spi0_sim_write(struct spi0 *s, unsigned int reg, uint32_t val)
+{
+	struct spi0_sim *sim = s->sim;
+
+	switch (reg) {
+	case SPI0_CS:
+		if (val & 0x10)
+			sim->tx_tail = sim->tx_head;
+		if (val & 0x20)
+			sim->rx_tail = sim->rx_head;
+		sim->cs = val & ~(SPI0_CS_CLEAR | SPI0_CS_DONE | SPI0_CS_RXD |
+				  SPI0_CS_TXD | SPI0_CS_RXR | SPI0_CS_RXF);
+		spi0_sim_shift(sim);
+		break;
+	case SPI0_FIFO:
+		if (sim->tx_head - sim->tx_tail < SPI0_FIFO_SIZE)
+			sim->tx[sim->tx_head++ % SPI0_FIFO_SIZE] = val;
+		spi0_sim_shift(sim);
+		break;
+	case SPI0_CLK:
+		sim->clk = val & 0xffff;
+		break;
+	case SPI0_DLEN:
+		sim->dlen = val & 0xffff;
+		break;
+	}
+}
+
+/* the SoC's peripheral window, as the device tree describes it */
+static off_t spi0_peri_base(void)
+{
+	uint8_t ranges[12];
+	off_t base = 0x20000000;
+	FILE *f;
+
+	f = fopen("/proc/device-tree/soc/ranges", "rb");
+	if (!f)
+		return base;
+	if (fread(ranges, 1, sizeof(ranges), f) == sizeof(ranges)) {
+		base = (off_t)ranges[4] << 24 | ranges[5] << 16 |
+		       ranges[6] << 8 | ranges[7];
+		/* BCM2711 has a 64 bit child address first */
+		if (!base)
+			base = (off_t)ranges[8] << 24 | ranges[9] << 16 |
+			       ranges[10] << 8 | ranges[11];
+	}
+	fclose(f);
+	return base;
+}
+
+static int spi0_chip_select(const char *path)
+{
+	size_t len = strlen(path);
+
+	if (len && path[len - 1] >= '0' && path[len - 1] <= '2')
+		return path[len - 1] - '0';
+	return 0;
+}
+
+static int mmio_open(struct spi_dev *dev)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	off_t addr = spi0_peri_base() + SPI0_OFFSET;
+	struct spi0 *s;
+	int fd;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -1;
+	fd = open("/dev/mem", O_RDWR | O_SYNC);
+	if (fd < 0) {
+		free(s);
+		return -1;
+	}
+	s->map = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		      addr & ~(page - 1));
+	close(fd);
+	if (s->map == MAP_FAILED) {
+		free(s);
+		return -1;
+	}
+	s->regs = (volatile uint32_t *)((char *)s->map + (addr & (page - 1)));
+	s->read = spi0_mmio_read;
+	s->write = spi0_mmio_write;
+	dev->priv = s;
+	dev->fd = -1;
+	return 0;
+}
+
+static int mmio_sim_open(struct spi_dev *dev)
+{
+	struct spi0 *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -1;
+	s->sim = calloc(1, sizeof(*s->sim));
+	if (!s->sim) {
+		free(s);
+		return -1;
+	}
+	s->read = spi0_sim_read;
+	s->write = spi0_sim_write;
+	dev->priv = s;
+	dev->fd = -1;
+	return 0;
+}
+
+static void spi0_set_clock(struct spi0 *s, uint32_t hz)
+{
+	uint32_t cdiv = (SPI0_CORE_HZ + hz - 1) / hz;
+
+	cdiv = (cdiv + 1) & ~1;
+	if (cdiv < 2)
+		cdiv = 2;
+	if (cdiv > 65534)
+		cdiv = 0;	/* 0 divides by 65536 */
+	s->write(s, SPI0_CLK, cdiv);
+	s->hz = hz;
+}
+
+static const char *mmio_setup(struct spi_dev *dev)
+{
+	struct spi0 *s = dev->priv;
+	uint32_t cdiv;
+
+	errno = EINVAL;
+	if (dev->mode & (SPI_TX_DUAL | SPI_TX_QUAD | SPI_RX_DUAL |
+			 SPI_RX_QUAD | SPI_3WIRE | SPI_LSB_FIRST))
+		return "can't set spi mode";
+	if (dev->bits != 8)
+		return "can't set bits per word";
+	if (!dev->speed)
+		return "can't set max speed hz";
+
+	s->cs = spi0_chip_select(dev->path);
+	if (dev->mode & SPI_CS_HIGH)
+		s->cs |= SPI0_CS_CSPOL | SPI0_CS_CSPOL0 << s->cs;
+	if (dev->mode & SPI_NO_CS)
+		s->cs |= SPI0_CS_CS;
+	if (dev->mode & SPI_CPHA)
+		s->cs |= SPI0_CS_CPHA;
+	if (dev->mode & SPI_CPOL)
+		s->cs |= SPI0_CS_CPOL;
+	s->write(s, SPI0_CS, s->cs | SPI0_CS_CLEAR);
+
+	spi0_set_clock(s, dev->speed);
+	cdiv = s->read(s, SPI0_CLK);
+	dev->speed = SPI0_CORE_HZ / (cdiv ? cdiv : 65536);
+	s->hz = dev->speed;
+	return NULL;
+}
+
+/* one transfer, TA (chip select) already asserted */
+static void spi0_transfer(struct spi0 *s, const uint8_t *tx, uint8_t *rx,
+			  size_t len)
+{
+	size_t t = 0, r = 0;
+	uint32_t cs;
+
+	while (r < len) {
+		/* keep no more than a FIFO's worth in flight */
+		while (t < len && t - r < SPI0_FIFO_SIZE &&
+		       (s->read(s, SPI0_CS) & SPI0_CS_TXD)) {
+			s->write(s, SPI0_FIFO, tx ? tx[t] : 0);
+			t++;
+		}
+		while (r < t) {
+			cs = s->read(s, SPI0_CS);
+			if (!(cs & SPI0_CS_RXD))
+				break;
+			cs = s->read(s, SPI0_FIFO);
+			if (rx)
+				rx[r] = cs;
+			r++;
+		}
+	}
+	while (!(s->read(s, SPI0_CS) & SPI0_CS_DONE))
+		;
+}
+
+static int mmio_message(struct spi_dev *dev, struct spi_ioc_transfer *tr,
+			int n)
+{
+	struct spi0 *s = dev->priv;
+	size_t total = 0;
+	uint32_t hz;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (tr[i].bits_per_word && tr[i].bits_per_word != 8) {
+			errno = EINVAL;
+			return -1;
+		}
+		hz = tr[i].speed_hz ? tr[i].speed_hz : dev->speed;
+		if (hz != s->hz)
+			spi0_set_clock(s, hz);
+
+		s->write(s, SPI0_CS, s->cs | SPI0_CS_CLEAR | SPI0_CS_TA);
+		spi0_transfer(s, (const uint8_t *)(unsigned long)tr[i].tx_buf,
+			      (uint8_t *)(unsigned long)tr[i].rx_buf,
+			      tr[i].len);
+		total += tr[i].len;
+
+		if (tr[i].delay_usecs)
+			emu_wait_until(now_ns() + tr[i].delay_usecs * 1000ULL);
+		/* cs_change: deselect in between, stay selected at the end */
+		if (!tr[i].cs_change == (i == n - 1))
+			s->write(s, SPI0_CS, s->cs);
+	}
+	return total;
+}
+
+static void mmio_close(struct spi_dev *dev)
+{
+	struct spi0 *s = dev->priv;
+
+	if (s->sim) {
+		free(s->sim);
+	} else {
+		s->write(s, SPI0_CS, s->cs | SPI0_CS_CLEAR);
+		munmap(s->map, sysconf(_SC_PAGESIZE));
+	}
+	free(s);
+}
+
+static const struct spi_transport transports[] = {
+	{ "spidev", spidev_open, spidev_setup, spidev_message, spidev_close },
+	{ "emu", emu_open, emu_setup, emu_message, emu_close },
+	{ "model", emu_open, emu_setup, model_message, emu_close },
+	{ "sdcard", sdemu_open, emu_setup, sdemu_message, sdemu_close },
+	{ "mmio", mmio_open, mmio_setup, mmio_message, mmio_close },
+	{ "mmio-sim", mmio_sim_open, mmio_setup, mmio_message, mmio_close },
+};
+
+static const struct spi_transport *transport_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(transports); i++)
+		if (!strcmp(name, transports[i].name))
+			return &transports[i];
+	fprintf(stderr, "unknown transport %s\n", name);
+	exit(1);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-DsbdlHOLC3vpNR24SI]\n", prog);
+	puts("  -D --device   device to use (default /dev/spidev1.1), may be\n"
+	     "                repeated to run one worker per device; per device\n"
+	     "                settings follow the path, e.g.\n"
+	     "                /dev/spidev0.0,speed=8000000,bits=8,mode=3,cpu=1\n"
+	     "                (also transport=T)\n"
+	     "  -s --speed    max speed (Hz)\n"
+	     "  -d --delay    delay (usec)\n"
+	     "  -b --bpw      bits per word\n"
+	     "  -i --input    input data from a file (e.g. \"test.bin\")\n"
+	     "  -o --output   output data to a file (e.g. \"results.bin\")\n"
+	     "  -l --loop     loopback\n"
+	     "  -H --cpha     clock phase\n"
+	     "  -O --cpol     clock polarity\n"
+	     "  -L --lsb      least significant bit first\n"
+	     "  -C --cs-high  chip select active high\n"
+	     "  -3 --3wire    SI/SO signals shared\n"
+	     "  -v --verbose  Verbose (show tx buffer)\n"
+	     "  -p            Send data (e.g. \"1234\\xde\\xad\")\n"
+	     "  -N --no-cs    no chip select\n"
+	     "  -R --ready    slave pulls low to pause\n"
+	     "  -2 --dual     dual transfer\n"
+	     "  -4 --quad     quad transfer\n"
+	     "  -S --size     transfer size\n"
+	     "  -I --iter     iterations\n"
+	     "  --batch N     pack N transfers of --size into one message\n"
+	     "  --cs-change   deselect chip between batched transfers\n"
+	     "  --seg-delay   delay between batched transfers (usec)\n"
+	     "  --pattern P   tx data: xorshift (default), counter, prbs7,\n"
+	     "                prbs15, prbs31, zeros, ones\n"
+	     "  --seed N      pattern seed, for reproducible runs\n"
+	     "  --mlock       lock transfer buffers in memory\n"
+	     "  --chunk SIZE  stream --input in SIZE byte transfers\n"
+	     "  --out-buf SIZE  coalesce --output writes (default 1MiB)\n"
+	     "  --out-sync    fdatasync the output after every flush\n"
+	     "  --out-direct  write the output with O_DIRECT\n"
+	     "  --pipeline[=DEPTH]  generate, transfer and verify on separate\n"
+	     "                threads with DEPTH buffers in flight (default 8)\n"
+	     "  --cpus P,T,V  pin generator, transfer and verify threads\n"
+	     "  --json        report rates and latency as JSON lines\n"
+	     "  --sweep GRID  measure every combination of the listed values,\n"
+	     "                separated by ':' (a list, not a range), e.g.\n"
+	     "                speed=1000000:8000000,size=32:512:4096,bits=8,\n"
+	     "                batch=1:16; -I transfers per point (default 1000)\n"
+	     "  --soak        count loopback bit errors instead of stopping at\n"
+	     "                the first; runs until -I or Ctrl-C\n"
+	     "  --soak-errors N  remember the offsets of the first N errors\n"
+	     "  --checkpoint FILE  save soak counters to FILE periodically\n"
+	     "  --checkpoint-interval SECS  (default 60)\n"
+	     "  --bufsiz N    split messages at N bytes (default: spidev's\n"
+	     "                bufsiz module parameter)\n"
+	     "  --cs-hold     keep chip select asserted across split messages\n"
+	     "  --transport T spidev (default), emu (built in loopback\n"
+	     "                emulator), model (scripted peripheral),\n"
+	     "                sdcard (emulated SD card), mmio (BCM2835 SPI0\n"
+	     "                registers through /dev/mem) or mmio-sim\n"
+	     "  --emu-latency USEC  per message overhead of emu and model\n"
+	     "  --emu-ber P   bit error rate injected by emu\n"
+	     "  --model FILE  peripheral script for --transport model\n"
+	     "  --rt[=PRIO]   run SCHED_FIFO (default priority 80) with all\n"
+	     "                memory locked and pre-faulted\n"
+	     "  --rt-cpu N    pin the run to cpu N in --rt mode\n"
+	     "  --rt-compare  run -S once normally and once with --rt and\n"
+	     "                compare their latency\n"
+	     "  --rate HZ     start messages at a fixed rate\n"
+	     "  --timerfd     pace with a timerfd instead of clock_nanosleep\n"
+	     "  --spin USEC   busy wait the last USEC before each deadline\n"
+	     "  --script FILE replay a multi segment transaction -I times,\n"
+	     "                one message per iteration\n"
+	     "  --half r|w    half duplex: -S byte read()s or write()s\n"
+	     "  --uring[=DEPTH]  queue --half transfers on an io_uring,\n"
+	     "                DEPTH in flight (default 8)\n"
+	     "  --adc BITS    capture -S byte frames of 12, 16 or 24 bit\n"
+	     "                big-endian samples, -I frames or until Ctrl-C;\n"
+	     "                --output gets host order int16/int32 samples\n"
+	     "  --adc-ring N  frames buffered for unpacking (default 64)\n"
+	     "  --sd          initialise an SD card and benchmark -I block\n"
+	     "                (default 1024) single and multi block reads\n"
+	     "  --sd-write    benchmark writes too and verify the reads;\n"
+	     "                overwrites the blocks on the card\n"
+	     "  --sd-lba N    first block to use (default 0)\n"
+	     "  --sd-multi N  blocks per multi block command (default 32)\n"
+	     "  --cpu-cost    count CPU cycles, instructions and context\n"
+	     "                switches of the run, per byte and transfer\n"
+	     "  --trace FILE  record every message for spidev_trace\n"
+	     "  --trace-bytes N  payload bytes kept per message (default 16)\n"
+	     "  --compare-transport T  run -S again on transport T and\n"
+	     "                compare their latency\n");
+	exit(1);
+}
+
+enum {
+	OPT_BATCH = 0x100,
+	OPT_CS_CHANGE,
+	OPT_SEG_DELAY,
+	OPT_PATTERN,
+	OPT_SEED,
+	OPT_MLOCK,
+	OPT_CHUNK,
+	OPT_OUT_BUF,
+	OPT_OUT_SYNC,
+	OPT_OUT_DIRECT,
+	OPT_PIPELINE,
+	OPT_CPUS,
+	OPT_JSON,
+	OPT_SWEEP,
+	OPT_SOAK,
+	OPT_SOAK_ERRORS,
+	OPT_CHECKPOINT,
+	OPT_CHECKPOINT_INTERVAL,
+	OPT_BUFSIZ,
+	OPT_CS_HOLD,
+	OPT_TRANSPORT,
+	OPT_EMU_LATENCY,
+	OPT_EMU_BER,
+	OPT_MODEL,
+	OPT_RT,
+	OPT_RT_CPU,
+	OPT_RT_COMPARE,
+	OPT_RATE,
+	OPT_TIMERFD,
+	OPT_SPIN,
+	OPT_SCRIPT,
+	OPT_HALF,
+	OPT_URING,
+	OPT_ADC,
+	OPT_ADC_RING,
+	OPT_SD,
+	OPT_SD_WRITE,
+	OPT_SD_LBA,
+	OPT_SD_MULTI,
+	OPT_CPU_COST,
+	OPT_TRACE,
+	OPT_TRACE_BYTES,
+	OPT_COMPARE_TRANSPORT,
+};
+
+static void parse_opts(int argc, char *argv[])
+{
+	while (1) {
+		static const struct option lopts[] = {
+			{ "device",  1, 0, 'D' },
+			{ "speed",   1, 0, 's' },
+			{ "delay",   1, 0, 'd' },
+			{ "bpw",     1, 0, 'b' },
+			{ "input",   1, 0, 'i' },
+			{ "output",  1, 0, 'o' },
+			{ "loop",    0, 0, 'l' },
+			{ "cpha",    0, 0, 'H' },
+			{ "cpol",    0, 0, 'O' },
+			{ "lsb",     0, 0, 'L' },
+			{ "cs-high", 0, 0, 'C' },
+			{ "3wire",   0, 0, '3' },
+			{ "no-cs",   0, 0, 'N' },
+			{ "ready",   0, 0, 'R' },
+			{ "dual",    0, 0, '2' },
+			{ "verbose", 0, 0, 'v' },
+			{ "quad",    0, 0, '4' },
+			{ "size",    1, 0, 'S' },
+			{ "iter",    1, 0, 'I' },
+			{ "batch",     1, 0, OPT_BATCH },
+			{ "cs-change", 0, 0, OPT_CS_CHANGE },
+			{ "seg-delay", 1, 0, OPT_SEG_DELAY },
+			{ "pattern",   1, 0, OPT_PATTERN },
+			{ "seed",      1, 0, OPT_SEED },
+			{ "mlock",     0, 0, OPT_MLOCK },
+			{ "chunk",     1, 0, OPT_CHUNK },
+			{ "out-buf",   1, 0, OPT_OUT_BUF },
+			{ "out-sync",  0, 0, OPT_OUT_SYNC },
+			{ "out-direct", 0, 0, OPT_OUT_DIRECT },
+			{ "pipeline",  2, 0, OPT_PIPELINE },
+			{ "cpus",      1, 0, OPT_CPUS },
+			{ "json",      0, 0, OPT_JSON },
+			{ "sweep",     1, 0, OPT_SWEEP },
+			{ "soak",      0, 0, OPT_SOAK },
+			{ "soak-errors", 1, 0, OPT_SOAK_ERRORS },
+			{ "checkpoint", 1, 0, OPT_CHECKPOINT },
+			{ "checkpoint-interval", 1, 0, OPT_CHECKPOINT_INTERVAL },
+			{ "bufsiz",    1, 0, OPT_BUFSIZ },
+			{ "cs-hold",   0, 0, OPT_CS_HOLD },
+			{ "transport", 1, 0, OPT_TRANSPORT },
+			{ "emu-latency", 1, 0, OPT_EMU_LATENCY },
+			{ "emu-ber",   1, 0, OPT_EMU_BER },
+			{ "model",     1, 0, OPT_MODEL },
+			{ "rt",        2, 0, OPT_RT },
+			{ "rt-cpu",    1, 0, OPT_RT_CPU },
+			{ "rt-compare", 0, 0, OPT_RT_COMPARE },
+			{ "rate",      1, 0, OPT_RATE },
+			{ "timerfd",   0, 0, OPT_TIMERFD },
+			{ "spin",      1, 0, OPT_SPIN },
+			{ "script",    1, 0, OPT_SCRIPT },
+			{ "half",      1, 0, OPT_HALF },
+			{ "uring",     2, 0, OPT_URING },
+			{ "adc",       1, 0, OPT_ADC },
+			{ "adc-ring",  1, 0, OPT_ADC_RING },
+			{ "sd",        0, 0, OPT_SD },
+			{ "sd-write",  0, 0, OPT_SD_WRITE },
+			{ "sd-lba",    1, 0, OPT_SD_LBA },
+			{ "sd-multi",  1, 0, OPT_SD_MULTI },
+			{ "cpu-cost",  0, 0, OPT_CPU_COST },
+			{ "trace",     1, 0, OPT_TRACE },
+			{ "trace-bytes", 1, 0, OPT_TRACE_BYTES },
+			{ "compare-transport", 1, 0, OPT_COMPARE_TRANSPORT },
+			{ NULL, 0, 0, 0 },
+		};
+		int c;
+
+		c = getopt_long(argc, argv, "D:s:d:b:i:o:lHOLC3NR24p:vS:I:",
+				lopts, NULL);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'D':
+			if (num_devices == MAX_DEVICES)
+				pabort("too many devices");
+			device_spec[num_devices++] = optarg;
+			break;
+		case 's':
+			speed = atoi(optarg);
+			break;
+		case 'd':
+			delay = atoi(optarg);
+			break;
+		case 'b':
+			bits = atoi(optarg);
+			break;
+		case 'i':
+			input_file = optarg;
+			break;
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'l':
+			mode |= SPI_LOOP;
+			break;
+		case 'H':
+			mode |= SPI_CPHA;
+			break;
+		case 'O':
+			mode |= SPI_CPOL;
+			break;
+		case 'L':
+			mode |= SPI_LSB_FIRST;
+			break;
+		case 'C':
+			mode |= SPI_CS_HIGH;
+			break;
+		case '3':
+			mode |= SPI_3WIRE;
+			break;
+		case 'N':
+			mode |= SPI_NO_CS;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'R':
+			mode |= SPI_READY;
+			break;
+		case 'p':
+			input_tx = optarg;
+			break;
+		case '2':
+			mode |= SPI_TX_DUAL;
+			break;
+		case '4':
+			mode |= SPI_TX_QUAD;
+			break;
+		case 'S':
+			transfer_size = atoi(optarg);
+			break;
+		case 'I':
+			iterations = atoi(optarg);
+			break;
+		case OPT_BATCH:
+			batch = atoi(optarg);
+			if (batch < 1 || batch > (int)MAX_BATCH) {
+				fprintf(stderr, "batch must be 1..%d\n",
+					(int)MAX_BATCH);
+				exit(1);
+			}
+			break;
+		case OPT_CS_CHANGE:
+			cs_change = 1;
+			break;
+		case OPT_SEG_DELAY:
+			seg_delay = atoi(optarg);
+			break;
+		case OPT_PATTERN:
+			pattern = pattern_parse(optarg);
+			if (pattern < 0) {
+				fprintf(stderr, "unknown pattern %s\n", optarg);
+				print_usage(argv[0]);
+			}
+			break;
+		case OPT_SEED:
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case OPT_MLOCK:
+			lock_buffers = 1;
+			break;
+		case OPT_CHUNK:
+			chunk_size = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_OUT_BUF:
+			out_buf_size = strtoul(optarg, NULL, 0);
+			if (!out_buf_size)
+				print_usage(argv[0]);
+			break;
+		case OPT_OUT_SYNC:
+			out_sync = 1;
+			break;
+		case OPT_OUT_DIRECT:
+			out_direct = 1;
+			break;
+		case OPT_PIPELINE:
+			pipeline = 1;
+			if (optarg)
+				pipeline_depth = atoi(optarg);
+			if (pipeline_depth < 2)
+				print_usage(argv[0]);
+			break;
+		case OPT_CPUS:
+			if (sscanf(optarg, "%d,%d,%d", &stage_cpu[0],
+				   &stage_cpu[1], &stage_cpu[2]) < 1)
+				print_usage(argv[0]);
+			break;
+		case OPT_JSON:
+			json = 1;
+			break;
+		case OPT_SWEEP:
+			sweep_spec = optarg;
+			break;
+		case OPT_SOAK:
+			soak = 1;
+			break;
+		case OPT_SOAK_ERRORS:
+			soak_max_errors = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_CHECKPOINT:
+			checkpoint_file = optarg;
+			break;
+		case OPT_CHECKPOINT_INTERVAL:
+			checkpoint_interval = atoi(optarg);
+			if (checkpoint_interval < 1)
+				print_usage(argv[0]);
+			break;
+		case OPT_BUFSIZ:
+			spidev_bufsiz = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_CS_HOLD:
+			cs_hold = 1;
+			break;
+		case OPT_TRANSPORT:
+			transport_name = optarg;
+			break;
+		case OPT_EMU_LATENCY:
+			emu_latency = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_EMU_BER:
+			emu_ber = strtod(optarg, NULL);
+			break;
+		case OPT_MODEL:
+			model_file = optarg;
+			break;
+		case OPT_RT:
+			rt_prio = optarg ? atoi(optarg) : 80;
+			if (rt_prio < sched_get_priority_min(SCHED_FIFO) ||
+			    rt_prio > sched_get_priority_max(SCHED_FIFO))
+				print_usage(argv[0]);
+			break;
+		case OPT_RT_CPU:
+			rt_cpu = atoi(optarg);
+			break;
+		case OPT_RT_COMPARE:
+			rt_compare = 1;
+			if (!rt_prio)
+				rt_prio = 80;
+			break;
+		case OPT_RATE:
+			pace_rate = strtod(optarg, NULL);
+			if (pace_rate <= 0 || pace_rate > 1e9)
+				print_usage(argv[0]);
+			break;
+		case OPT_TIMERFD:
+			pace_timerfd = 1;
+			break;
+		case OPT_SPIN:
+			pace_spin = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_SCRIPT:
+			script_file = optarg;
+			break;
+		case OPT_HALF:
+			if (optarg[0] != 'r' && optarg[0] != 'w')
+				print_usage(argv[0]);
+			half_duplex = optarg[0];
+			break;
+		case OPT_URING:
+			uring_depth = optarg ? atoi(optarg) : 8;
+			if (uring_depth < 1 || uring_depth > 4096)
+				print_usage(argv[0]);
+			break;
+		case OPT_ADC:
+			adc_bits = atoi(optarg);
+			if (adc_bits != 12 && adc_bits != 16 && adc_bits != 24)
+				print_usage(argv[0]);
+			break;
+		case OPT_ADC_RING:
+			adc_ring = atoi(optarg);
+			if (adc_ring < 1)
+				print_usage(argv[0]);
+			break;
+		case OPT_SD:
+			sd_mode = 1;
+			break;
+		case OPT_SD_WRITE:
+			sd_write = 1;
+			break;
+		case OPT_SD_LBA:
+			sd_lba = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_SD_MULTI:
+			sd_multi = atoi(optarg);
+			if (sd_multi < 1)
+				print_usage(argv[0]);
+			break;
+		case OPT_CPU_COST:
+			cpu_cost = 1;
+			break;
+		case OPT_TRACE:
+			trace_file = optarg;
+			break;
+		case OPT_TRACE_BYTES:
+			trace_sample = strtoul(optarg, NULL, 0);
+			if (trace_sample > SPI_TRACE_SAMPLE_MAX)
+				print_usage(argv[0]);
+			break;
+		case OPT_COMPARE_TRANSPORT:
+			transport_find(optarg);	/* exits if unknown */
+			compare_transport = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+			break;
+		}
+	}
+	if (mode & SPI_LOOP) {
+		if (mode & SPI_TX_DUAL)
+			mode |= SPI_RX_DUAL;
+		if (mode & SPI_TX_QUAD)
+			mode |= SPI_RX_QUAD;
+	}
+}
+
+static void transfer_escaped_string(struct spi_dev *dev, char *str)
+{
+	size_t size = strlen(str);
+	uint8_t *tx;
+	uint8_t *rx;
+
+	tx = malloc(size);
+	if (!tx)
+		pabort("can't allocate tx buffer");
+
+	rx = malloc(size);
+	if (!rx)
+		pabort("can't allocate rx buffer");
+
+	size = unescape((char *)tx, str, size);
+	transfer(dev, tx, rx, size);
+	free(rx);
+	free(tx);
+}
+
+static void transfer_file(struct spi_dev *dev, char *filename)
+{
+	ssize_t bytes;
+	struct stat sb;
+	int tx_fd;
+	uint8_t *tx;
+	uint8_t *rx;
+
+	if (stat(filename, &sb) == -1)
+		pabort("can't stat input file");
+
+	tx_fd = open(filename, O_RDONLY);
+	if (tx_fd < 0)
+		pabort("can't open input file");
+
+	tx = malloc(sb.st_size);
+	if (!tx)
+		pabort("can't allocate tx buffer");
+
+	rx = malloc(sb.st_size);
+	if (!rx)
+		pabort("can't allocate rx buffer");
+
+	bytes = read(tx_fd, tx, sb.st_size);
+	if (bytes != sb.st_size)
+		pabort("failed to read input file");
+
+	transfer(dev, tx, rx, sb.st_size);
+	free(rx);
+	free(tx);
+	close(tx_fd);
+}
+
+static void stream_chunk(struct spi_dev *dev, uint8_t const *tx, uint8_t *rx,
+			 size_t len)
+{
+	struct spi_ioc_transfer tr;
+
+	setup_transfer(dev, &tr, tx, rx, len);
+	spi_submit(dev, &tr, 1);
+
+	if (verbose) {
+		hex_dump(tx, len, 32, "TX");
+		hex_dump(rx, len, 32, "RX");
+	}
+	if (output_file)
+		sink_write(&out, rx, len);
+
+	dev->write_count += len;
+	dev->read_count += len;
+}
+
+/*
+ * Stream an input file of any size through a fixed chunk_size window.
+ * Regular files are mapped and sent straight from the page cache: while
+ * one chunk is on the bus the next is already being read ahead, and
+ * pages behind the window are dropped again so the resident set stays
+ * bounded. Anything that can't be mapped (pipes, character devices) is
+ * read chunk by chunk into one buffer. RX goes to the output sink per chunk.
+ */
+static void transfer_file_stream(struct spi_dev *dev, char *filename)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	struct stat sb;
+	int tx_fd;
+	uint8_t *map;
+	uint8_t *tx;
+	uint8_t *rx;
+	size_t size, off, len, next, dropped = 0;
+	unsigned long long chunks = 0;	/* messages may be split at bufsiz */
+	ssize_t bytes;
+
+	tx_fd = open(filename, O_RDONLY);
+	if (tx_fd < 0)
+		pabort("can't open input file");
+	if (fstat(tx_fd, &sb) == -1)
+		pabort("can't stat input file");
+
+	rx = pool_alloc_buf(chunk_size);
+	size = sb.st_size;
+
+	map = MAP_FAILED;
+	if (S_ISREG(sb.st_mode) && size)
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, tx_fd, 0);
+
+	if (map != MAP_FAILED) {
+		madvise(map, size, MADV_SEQUENTIAL);
+		for (off = 0; off < size; off += len) {
+			len = size - off < chunk_size ? size - off : chunk_size;
+
+			next = size - off - len;
+			if (next)
+				madvise(map + ((off + len) & ~(page - 1)),
+					(next < chunk_size ? next : chunk_size) +
+					page, MADV_WILLNEED);
+
+			stream_chunk(dev, map + off, rx, len);
+			chunks++;
+
+			if (((off + len) & ~(page - 1)) > dropped) {
+				madvise(map + dropped,
+					((off + len) & ~(page - 1)) - dropped,
+					MADV_DONTNEED);
+				dropped = (off + len) & ~(page - 1);
+			}
+		}
+		munmap(map, size);
+	} else if (size || !S_ISREG(sb.st_mode)) {
+		tx = pool_alloc_buf(chunk_size);
+		for (;;) {
+			for (len = 0; len < chunk_size; len += bytes) {
+				bytes = read(tx_fd, tx + len, chunk_size - len);
+				if (bytes < 0)
+					pabort("failed to read input file");
+				if (!bytes)
+					break;
+			}
+			if (!len)
+				break;
+			stream_chunk(dev, tx, rx, len);
+			chunks++;
+		}
+		free(tx);
+	}
+
+	printf("total: tx %.1fKB, rx %.1fKB in %llu chunks of %zu bytes\n",
+	       dev->write_count/1024.0, dev->read_count/1024.0,
+	       chunks, chunk_size);
+	show_latency(&dev->lat_total, "latency");
+
+	free(rx);
+	close(tx_fd);
+}
+
+static double elapsed_sec(const struct timespec *from,
+			  const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) +
+	       (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* device name in front of each report once more than one device runs */
+static void show_device(const struct spi_dev *dev)
+{
+	if (json)
+		printf("\"device\":\"%s\",", dev->path);
+	else if (num_devices > 1)
+		printf("%s: ", dev->path);
+}
+
+static void show_transfer_rate(struct spi_dev *dev, double secs)
+{
+	double rx_rate, tx_rate, byte_rate, ioctl_rate;
+
+	rx_rate = ((dev->read_count - dev->prev_read_count) * 8) /
+		  (secs*1000.0);
+	tx_rate = ((dev->write_count - dev->prev_write_count) * 8) /
+		  (secs*1000.0);
+	byte_rate = (dev->write_count > dev->read_count ?
+		     dev->write_count - dev->prev_write_count :
+		     dev->read_count - dev->prev_read_count) / secs;
+	ioctl_rate = (dev->ioctl_count - dev->prev_ioctl_count) / secs;
+
+	flockfile(stdout);
+	if (json) {
+		printf("{\"type\":\"interval\",");
+		show_device(dev);
+		printf("\"secs\":%.3f,\"tx_kbps\":%.1f,\"rx_kbps\":%.1f,"
+		       "\"bytes_per_sec\":%.0f,\"syscalls_per_sec\":%.0f,",
+		       secs, tx_rate, rx_rate, byte_rate, ioctl_rate);
+		show_latency(&dev->lat_interval, "latency_us");
+		printf("}\n");
+	} else {
+		show_device(dev);
+		printf("rate: tx %.1fkbps, rx %.1fkbps, %.0f B/s, "
+		       "%.0f syscalls/s\n",
+		       tx_rate, rx_rate, byte_rate, ioctl_rate);
+		if (dev->lat_interval.n) {
+			show_device(dev);
+			show_latency(&dev->lat_interval, "latency");
+		}
+	}
+	fflush(stdout);
+	funlockfile(stdout);
+
+	dev->prev_read_count = dev->read_count;
+	dev->prev_write_count = dev->write_count;
+	dev->prev_ioctl_count = dev->ioctl_count;
+	hist_reset(&dev->lat_interval);
+}
+
+/*
+ * Soak comparison: xor tx against rx a word at a time and only look
+ * closer at words that differ. Bit errors are the popcount of the xor;
+ * for byte errors every non-zero byte of the xor is folded into its top
+ * bit first. Clean 32 byte blocks cost four loads, xors and one branch.
+ */
+#define LO7	0x7f7f7f7f7f7f7f7fULL
+
+static void soak_word(struct soak_stats *st, uint64_t off, uint64_t x)
+{
+	uint64_t t = (((x & LO7) + LO7) | x) & ~LO7;
+	int byte;
+
+	st->bit_errors += __builtin_popcountll(x);
+	st->byte_errors += __builtin_popcountll(t);
+
+	for (; t && st->nerr < soak_max_errors; t &= t - 1) {
+		byte = __builtin_ctzll(t) / 8;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		byte = 7 - byte;
+#endif
+		st->err_offset[st->nerr++] = off + byte;
+	}
+}
+
+static void soak_compare(struct soak_stats *st, uint8_t const *tx,
+			 uint8_t const *rx, size_t len)
+{
+	uint64_t a[4], b[4], x[4];
+	size_t i = 0;
+	int w;
+
+	for (; i + 32 <= len; i += 32) {
+		memcpy(a, tx + i, 32);
+		memcpy(b, rx + i, 32);
+		for (w = 0; w < 4; w++)
+			x[w] = a[w] ^ b[w];
+		if (!(x[0] | x[1] | x[2] | x[3]))
+			continue;
+		for (w = 0; w < 4; w++)
+			if (x[w])
+				soak_word(st, st->bytes + i + w * 8, x[w]);
+	}
+	for (; i < len; i++) {
+		if (tx[i] == rx[i])
+			continue;
+		st->bit_errors += __builtin_popcount(tx[i] ^ rx[i]);
+		st->byte_errors++;
+		if (st->nerr < soak_max_errors)
+			st->err_offset[st->nerr++] = st->bytes + i;
+	}
+	st->bytes += len;
+}
+
+/* 95% Wilson score interval, meaningful even with no errors seen yet */
+static void ber_bounds(uint64_t errors, uint64_t bits, double *lo, double *hi)
+{
+	const double z = 1.959964;
+	double n = bits, p, c, d, h;
+
+	if (!bits) {
+		*lo = 0;
+		*hi = 1;
+		return;
+	}
+	p = errors / n;
+	d = 1 + z * z / n;
+	c = (p + z * z / (2 * n)) / d;
+	h = z * sqrt(p * (1 - p) / n + z * z / (4 * n * n)) / d;
+	*lo = c - h > 0 ? c - h : 0;
+	*hi = c + h;
+}
+
+static void soak_show(struct spi_dev *dev, const char *type)
+{
+	struct soak_stats *st = &dev->soak;
+	uint64_t bits = st->bytes * 8;
+	double lo, hi;
+	unsigned int i;
+
+	ber_bounds(st->bit_errors, bits, &lo, &hi);
+
+	flockfile(stdout);
+	if (json) {
+		printf("{\"type\":\"%s\",", type);
+		show_device(dev);
+		printf("\"bits\":%llu,\"bit_errors\":%llu,"
+		       "\"byte_errors\":%llu,\"ber\":%g,\"ber_lo\":%g,"
+		       "\"ber_hi\":%g,\"new_bit_errors\":%llu,"
+		       "\"first_errors\":[",
+		       (unsigned long long)bits,
+		       (unsigned long long)st->bit_errors,
+		       (unsigned long long)st->byte_errors,
+		       bits ? (double)st->bit_errors / bits : 0, lo, hi,
+		       (unsigned long long)(st->bit_errors -
+					    st->prev_bit_errors));
+		for (i = 0; i < st->nerr; i++)
+			printf("%s%llu", i ? "," : "",
+			       (unsigned long long)st->err_offset[i]);
+		printf("]}\n");
+	} else {
+		show_device(dev);
+		printf("%s: %llu bits, %llu bit errors in %llu bytes, "
+		       "BER %.3g (95%% %.3g..%.3g), +%llu since last\n", type,
+		       (unsigned long long)bits,
+		       (unsigned long long)st->bit_errors,
+		       (unsigned long long)st->byte_errors,
+		       bits ? (double)st->bit_errors / bits : 0, lo, hi,
+		       (unsigned long long)(st->bit_errors -
+					    st->prev_bit_errors));
+		if (st->nerr && !strcmp(type, "soak total")) {
+			show_device(dev);
+			printf("first error offsets:");
+			for (i = 0; i < st->nerr; i++)
+				printf(" %llu",
+				       (unsigned long long)st->err_offset[i]);
+			printf("\n");
+		}
+	}
+	fflush(stdout);
+	funlockfile(stdout);
+
+	st->prev_bytes = st->bytes;
+	st->prev_bit_errors = st->bit_errors;
+}
+
+/* written to a temporary name and renamed, so a crash never leaves half */
+static void soak_checkpoint(struct spi_dev *dev)
+{
+	struct soak_stats *st = &dev->soak;
+	char path[PATH_MAX], tmp[PATH_MAX + 4];
+	struct timespec now;
+	uint64_t bits = st->bytes * 8;
+	double lo, hi;
+	unsigned int i;
+	FILE *f;
+
+	if (num_devices > 1)
+		snprintf(path, sizeof(path), "%s.%d", checkpoint_file,
+			 (int)(dev - devices));
+	else
+		snprintf(path, sizeof(path), "%s", checkpoint_file);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	f = fopen(tmp, "w");
+	if (!f)
+		pabort("can't write checkpoint");
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ber_bounds(st->bit_errors, bits, &lo, &hi);
+	fprintf(f, "{\"device\":\"%s\",\"secs\":%.3f,\"bytes\":%llu,"
+		"\"bits\":%llu,\"bit_errors\":%llu,\"byte_errors\":%llu,"
+		"\"ber\":%g,\"ber_lo\":%g,\"ber_hi\":%g,\"first_errors\":[",
+		dev->path, elapsed_sec(&st->start, &now),
+		(unsigned long long)st->bytes, (unsigned long long)bits,
+		(unsigned long long)st->bit_errors,
+		(unsigned long long)st->byte_errors,
+		bits ? (double)st->bit_errors / bits : 0, lo, hi);
+	for (i = 0; i < st->nerr; i++)
+		fprintf(f, "%s%llu", i ? "," : "",
+			(unsigned long long)st->err_offset[i]);
+	fprintf(f, "]}\n");
+
+	if (fclose(f) || rename(tmp, path))
+		pabort("can't write checkpoint");
+	st->last_checkpoint = now;
+}
+
+static void soak_start(struct spi_dev *dev)
+{
+	struct soak_stats *st = &dev->soak;
+
+	st->err_offset = calloc(soak_max_errors + 1, sizeof(*st->err_offset));
+	if (!st->err_offset)
+		pabort("can't allocate soak error log");
+	clock_gettime(CLOCK_MONOTONIC, &st->start);
+	st->last_report = st->start;
+	st->last_checkpoint = st->start;
+}
+
+/* called by whichever thread does the comparing, like rate_tick() */
+static void soak_tick(struct spi_dev *dev)
+{
+	struct soak_stats *st = &dev->soak;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec - st->last_report.tv_sec > interval) {
+		soak_show(dev, "soak");
+		st->last_report = now;
+	}
+	if (checkpoint_file &&
+	    now.tv_sec - st->last_checkpoint.tv_sec >= checkpoint_interval)
+		soak_checkpoint(dev);
+}
+
+static void soak_finish(struct spi_dev *dev)
+{
+	soak_show(dev, "soak total");
+	if (checkpoint_file)
+		soak_checkpoint(dev);
+	free(dev->soak.err_offset);
+}
+
+static void verify_buf(struct spi_dev *dev, uint8_t const *tx,
+		       uint8_t const *rx, int len)
+{
+	if (soak) {
+		soak_compare(&dev->soak, tx, rx, len);
+		soak_tick(dev);
+		return;
+	}
+
+	if (memcmp(tx, rx, len)) {
+		fprintf(stderr, "transfer error !\n");
+		hex_dump(tx, len, 32, "TX");
+		hex_dump(rx, len, 32, "RX");
+		exit(1);
+	}
+}
+
+/* -I transfers, or an open ended soak until interrupted */
+static long long run_length(void)
+{
+	return soak && !iterations ? LLONG_MAX : iterations;
+}
+
+static void transfer_buf(struct spi_dev *dev, struct buf_pool *pool,
+			 struct pattern_gen *gen, int len, int n)
+{
+	uint8_t *tx = pool->tx;
+	uint8_t *rx = pool->rx;
+	int total = len * n;
+
+	pattern_fill(gen, tx, total);
+
+	transfer_batch(dev, tx, rx, len, n);
+
+	dev->write_count += total;
+	dev->read_count += total;
+
+	if (dev->mode & SPI_LOOP)
+		verify_buf(dev, tx, rx, total);
+}
+
+static void rate_tick(struct spi_dev *dev, struct timespec *last_stat)
+{
+	struct timespec current;
+
+	clock_gettime(CLOCK_MONOTONIC, &current);
+	if (current.tv_sec - last_stat->tv_sec > interval) {
+		show_transfer_rate(dev, elapsed_sec(last_stat, &current));
+		*last_stat = current;
+	}
+}
+
+static void show_totals(const char *type, const struct spi_dev *dev)
+{
+	double secs = dev->secs;
+	uint64_t bytes = dev->write_count > dev->read_count ?
+			 dev->write_count : dev->read_count;
+
+	flockfile(stdout);
+	if (json) {
+		printf("{\"type\":\"%s\",", type);
+		show_device(dev);
+		printf("\"secs\":%.3f,\"tx_bytes\":%llu,\"rx_bytes\":%llu,"
+		       "\"syscalls\":%llu,\"bytes_per_sec\":%.0f,"
+		       "\"syscalls_per_sec\":%.0f,",
+		       secs, (unsigned long long)dev->write_count,
+		       (unsigned long long)dev->read_count,
+		       (unsigned long long)dev->ioctl_count,
+		       secs > 0 ? bytes / secs : 0.0,
+		       secs > 0 ? dev->ioctl_count / secs : 0.0);
+		show_latency(&dev->lat_total, "latency_us");
+		printf("}\n");
+		funlockfile(stdout);
+		return;
+	}
+
+	show_device(dev);
+	printf("%s: tx %.1fKB, rx %.1fKB\n", type,
+	       dev->write_count/1024.0, dev->read_count/1024.0);
+	show_device(dev);
+	printf("%s: %.0f B/s, %llu syscalls, %.0f syscalls/s\n", type,
+	       secs > 0 ? bytes / secs : 0.0,
+	       (unsigned long long)dev->ioctl_count,
+	       secs > 0 ? dev->ioctl_count / secs : 0.0);
+	if (dev->lat_total.n) {
+		show_device(dev);
+		show_latency(&dev->lat_total, "latency");
+	}
+	funlockfile(stdout);
+}
+
+/*
+ * --rate: every message starts at an absolute deadline, so time lost on
+ * one message is not carried over to the next. The wait is either an
+ * absolute clock_nanosleep() or a periodic timerfd, optionally ending in
+ * --spin usecs of busy waiting to take the wakeup latency out. A
+ * deadline counts as missed when the message could not start before the
+ * following one was due; those periods are skipped, not made up for.
+ */
+static inline uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ns_to_ts(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static void pace_start(struct pacer *pc)
+{
+	struct itimerspec its;
+	uint64_t spin = pace_spin * 1000ULL;
+
+	pc->period = 1e9 / pace_rate;
+	pc->start = mono_ns();
+	pc->next = pc->start + pc->period;
+	pc->frames = 0;
+	pc->missed = 0;
+	pc->tfd = -1;
+	hist_reset(&pc->late);
+
+	if (!pace_timerfd)
+		return;
+
+	pc->tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (pc->tfd < 0)
+		pabort("can't create timerfd");
+	ns_to_ts(pc->next - (spin < pc->period ? spin : 0), &its.it_value);
+	ns_to_ts(pc->period, &its.it_interval);
+	if (timerfd_settime(pc->tfd, TFD_TIMER_ABSTIME, &its, NULL))
+		pabort("can't arm timerfd");
+}
+
+static void pace_wait(struct pacer *pc)
+{
+	uint64_t spin = pace_spin * 1000ULL;
+	struct timespec ts;
+	uint64_t now, exp;
+
+	if (pc->tfd >= 0) {
+		if (read(pc->tfd, &exp, sizeof(exp)) != sizeof(exp))
+			pabort("can't read timerfd");
+		if (exp > 1) {
+			pc->missed += exp - 1;
+			pc->next += (exp - 1) * pc->period;
+		}
+	} else if (pc->next > spin) {
+		ns_to_ts(pc->next - spin, &ts);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	while ((now = mono_ns()) < pc->next)
+		;
+
+	hist_record(&pc->late, now - pc->next);
+	pc->frames++;
+	pc->next += pc->period;
+
+	if (pc->tfd < 0 && now >= pc->next) {
+		exp = (now - pc->next) / pc->period + 1;
+		pc->missed += exp;
+		pc->next += exp * pc->period;
+	}
+}
+
+static void pace_finish(struct spi_dev *dev)
+{
+	struct pacer *pc = &dev->pace;
+	double secs = (mono_ns() - pc->start) / 1e9;
+
+	if (pc->tfd >= 0)
+		close(pc->tfd);
+
+	flockfile(stdout);
+	if (json) {
+		printf("{\"type\":\"pacing\",");
+		show_device(dev);
+		printf("\"target_hz\":%.3f,\"achieved_hz\":%.3f,"
+		       "\"messages\":%llu,\"missed\":%llu,",
+		       pace_rate, secs > 0 ? pc->frames / secs : 0,
+		       (unsigned long long)pc->frames,
+		       (unsigned long long)pc->missed);
+		show_latency(&pc->late, "lateness_us");
+		printf("}\n");
+	} else {
+		show_device(dev);
+		printf("pacing: target %.1f Hz, achieved %.1f Hz, %llu messages, "
+		       "%llu missed deadlines\n",
+		       pace_rate, secs > 0 ? pc->frames / secs : 0,
+		       (unsigned long long)pc->frames,
+		       (unsigned long long)pc->missed);
+		show_device(dev);
+		show_latency(&pc->late, "lateness");
+	}
+	funlockfile(stdout);
+}
+
+static void finish_run(struct spi_dev *dev, const struct timespec *start)
+{
+	struct timespec current;
+
+	clock_gettime(CLOCK_MONOTONIC, &current);
+	dev->secs = elapsed_sec(start, &current);
+	show_totals("total", dev);
+	if (pace_rate)
+		pace_finish(dev);
+}
+
+static void transfer_loop(struct spi_dev *dev)
+{
+	struct timespec start, last_stat;
+	struct pattern_gen gen;
+	struct buf_pool pool;
+	long long left = run_length();
+
+	pool_init(&pool, (size_t)transfer_size * batch);
+	pattern_init(&gen, pattern, seed);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last_stat = start;
+
+	if (pace_rate)
+		pace_start(&dev->pace);
+
+	/* -I counts transfers; --batch groups them per syscall */
+	while (left > 0 && !stop) {
+		int n = left < batch ? left : batch;
+
+		if (pace_rate)
+			pace_wait(&dev->pace);
+		transfer_buf(dev, &pool, &gen, transfer_size, n);
+		left -= n;
+		rate_tick(dev, &last_stat);
+	}
+	finish_run(dev, &start);
+	pool_free(&pool);
+}
+
+/*
+ * --script: a transaction made of segments, one per line:
+ *
+ *	tx=9f rx=3 speed=1000000 bits=8 delay=10 cs_change repeat=4
+ *
+ * tx= gives the bytes to send (hex), rx= how many to receive; a segment
+ * clocks max(tx, rx) bytes, padding tx with zeros. speed=, bits= and
+ * delay= override the device settings for that segment, cs_change
+ * deselects the chip after it and repeat= emits it several times. The
+ * script is compiled once into a transfer array over one tx and one rx
+ * buffer and every -I iteration replays it as a single message.
+ */
+struct spi_script {
+	struct spi_ioc_transfer tr[MAX_BATCH];
+	int n;
+	uint8_t *tx;
+	uint8_t *rx;
+	size_t size;
+};
+
+static void script_compile(struct spi_dev *dev, struct spi_script *sc,
+			   const char *filename)
+{
+	char line[4096], *tok, *val, *save;
+	uint8_t data[sizeof(line) / 2];
+	struct spi_ioc_transfer seg, *tr;
+	size_t tx_len, rx_len, len, word;
+	int lineno = 0, repeat, i;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+		pabort("can't open script file");
+
+	memset(sc, 0, sizeof(*sc));
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		tok = strchr(line, '#');
+		if (tok)
+			*tok = 0;
+
+		/* built aside, the array may already be full */
+		tr = &seg;
+		setup_transfer(dev, tr, NULL, NULL, 0);
+		tx_len = rx_len = 0;
+		repeat = 1;
+
+		for (tok = strtok_r(line, " \t\r\n", &save); tok;
+		     tok = strtok_r(NULL, " \t\r\n", &save)) {
+			val = strchr(tok, '=');
+			if (val)
+				*val++ = 0;
+			if (!strcmp(tok, "cs_change") && !val) {
+				tr->cs_change = 1;
+				continue;
+			}
+			if (!val || !*val)
+				goto bad;
+			if (!strcmp(tok, "tx")) {
+				tx_len = parse_hex(val, data, sizeof(data));
+				if (!tx_len)
+					goto bad;
+			} else if (!strcmp(tok, "rx"))
+				rx_len = strtoul(val, NULL, 0);
+			else if (!strcmp(tok, "speed"))
+				tr->speed_hz = strtoul(val, NULL, 0);
+			else if (!strcmp(tok, "bits"))
+				tr->bits_per_word = strtoul(val, NULL, 0);
+			else if (!strcmp(tok, "delay"))
+				tr->delay_usecs = strtoul(val, NULL, 0);
+			else if (!strcmp(tok, "repeat"))
+				repeat = strtol(val, NULL, 0);
+			else
+				goto bad;
+		}
+
+		len = tx_len > rx_len ? tx_len : rx_len;
+		if (!len && (tx_len || rx_len || repeat != 1 ||
+			     tr->cs_change))
+			goto bad;
+		if (!len)
+			continue;
+		word = tr->bits_per_word > 16 ? 4 :
+		       tr->bits_per_word > 8 ? 2 : 1;
+		if (repeat < 1 || len % word || !tr->speed_hz)
+			goto bad;
+		if (repeat > (int)MAX_BATCH - sc->n) {
+			fprintf(stderr, "%s:%d: more than %d segments\n",
+				filename, lineno, (int)MAX_BATCH);
+			exit(1);
+		}
+
+		sc->tx = realloc(sc->tx, sc->size + len * repeat);
+		if (!sc->tx)
+			pabort("can't allocate tx buffer");
+
+		/* buffer offsets for now, rx_buf only marks a receive */
+		tr->len = len;
+		tr->rx_buf = rx_len != 0;
+		for (i = 0; i < repeat; i++) {
+			memcpy(sc->tx + sc->size, data, tx_len);
+			memset(sc->tx + sc->size + tx_len, 0, len - tx_len);
+			sc->tr[sc->n + i] = *tr;
+			sc->tr[sc->n + i].tx_buf = sc->size;
+			sc->size += len;
+		}
+		sc->n += repeat;
+	}
+	fclose(f);
+
+	if (!sc->n) {
+		fprintf(stderr, "%s: no segments\n", filename);
+		exit(1);
+	}
+
+	sc->rx = pool_alloc_buf(sc->size);
+	for (i = 0; i < sc->n; i++) {
+		tr = &sc->tr[i];
+		if (tr->rx_buf)
+			tr->rx_buf = (unsigned long)(sc->rx + tr->tx_buf);
+		tr->tx_buf = (unsigned long)(sc->tx + tr->tx_buf);
+	}
+	return;
+bad:
+	fprintf(stderr, "%s:%d: expected \"[tx=<hex>] [rx=N] [speed=HZ] "
+		"[bits=N] [delay=USEC] [cs_change] [repeat=N]\"\n",
+		filename, lineno);
+	exit(1);
+}
+
+static void script_output(const struct spi_script *sc)
+{
+	const struct spi_ioc_transfer *tr;
+	int i;
+
+	for (i = 0; i < sc->n; i++) {
+		tr = &sc->tr[i];
+		if (verbose)
+			hex_dump((void *)(unsigned long)tr->tx_buf, tr->len,
+				 32, "TX");
+		if (!tr->rx_buf)
+			continue;
+		if (output_file)
+			sink_write(&out, (void *)(unsigned long)tr->rx_buf,
+				   tr->len);
+		if (verbose)
+			hex_dump((void *)(unsigned long)tr->rx_buf, tr->len,
+				 32, "RX");
+	}
+}
+
+static void run_script(struct spi_dev *dev)
+{
+	struct timespec start, last_stat;
+	struct spi_script sc;
+	long long left = iterations ? iterations : 1;
+
+	script_compile(dev, &sc, script_file);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last_stat = start;
+
+	if (pace_rate)
+		pace_start(&dev->pace);
+
+	while (left-- > 0 && !stop) {
+		if (pace_rate)
+			pace_wait(&dev->pace);
+		spi_submit(dev, sc.tr, sc.n);
+		dev->write_count += sc.size;
+		dev->read_count += sc.size;
+		script_output(&sc);
+		rate_tick(dev, &last_stat);
+	}
+	finish_run(dev, &start);
+
+	free(sc.rx);
+	free(sc.tx);
+}
+
+/*
+ * --half: half duplex transfers through spidev's read() and write(), -S
+ * bytes each (at most bufsiz), -I of them. Without --uring every
+ * transfer is one blocking syscall. With --uring up to DEPTH of them are
+ * queued on an io_uring over registered buffers and completions are
+ * reaped in batches, so a single io_uring_enter() both refills the queue
+ * and collects everything that finished. spidev serialises its users and
+ * can't do non-blocking I/O, so the requests run on an io-wq worker;
+ * limiting that to one worker keeps them in submission order, which is
+ * also the order received data is written to --output. Latency is per
+ * transfer, from queueing to completion; syscalls are io_uring_enter()
+ * calls.
+ */
+struct uring {
+	int fd;
+	unsigned int entries;
+	_Atomic unsigned int *sq_head, *sq_tail;
+	_Atomic unsigned int *cq_head, *cq_tail;
+	unsigned int sq_mask, cq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+	int fixed;		/* buffers are registered */
+};
+
+static void uring_init(struct uring *u, unsigned int depth)
+{
+	struct io_uring_params p;
+	unsigned int workers[2] = { 0, 1 };
+
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (u->fd < 0)
+		pabort("can't set up io_uring");
+
+	u->entries = p.sq_entries;
+	u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_map_len = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_map_len > u->sq_map_len)
+			u->sq_map_len = u->cq_map_len;
+		u->cq_map_len = u->sq_map_len;
+	}
+
+	u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_map == MAP_FAILED)
+		pabort("can't map io_uring");
+	u->cq_map = u->sq_map;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		u->cq_map = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, u->fd,
+				 IORING_OFF_CQ_RING);
+		if (u->cq_map == MAP_FAILED)
+			pabort("can't map io_uring");
+	}
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		pabort("can't map io_uring");
+
+	u->sq_head = (void *)((char *)u->sq_map + p.sq_off.head);
+	u->sq_tail = (void *)((char *)u->sq_map + p.sq_off.tail);
+	u->sq_mask = *(unsigned int *)((char *)u->sq_map + p.sq_off.ring_mask);
+	u->sq_array = (void *)((char *)u->sq_map + p.sq_off.array);
+	u->cq_head = (void *)((char *)u->cq_map + p.cq_off.head);
+	u->cq_tail = (void *)((char *)u->cq_map + p.cq_off.tail);
+	u->cq_mask = *(unsigned int *)((char *)u->cq_map + p.cq_off.ring_mask);
+	u->cqes = (void *)((char *)u->cq_map + p.cq_off.cqes);
+
+#ifdef IORING_REGISTER_IOWQ_MAX_WORKERS
+	/* best effort: older kernels run the queue on several workers */
+	syscall(__NR_io_uring_register, u->fd,
+		IORING_REGISTER_IOWQ_MAX_WORKERS, workers, 2);
+#else
+	(void)workers;
+#endif
+}
+
+static void uring_register(struct uring *u, uint8_t **bufs, unsigned int n,
+			   size_t len)
+{
+	struct iovec iov[n];
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = len;
+	}
+	/* registration pins the pages; fall back when RLIMIT_MEMLOCK says no */
+	u->fixed = !syscall(__NR_io_uring_register, u->fd,
+			    IORING_REGISTER_BUFFERS, iov, n);
+}
+
+static void uring_queue(struct uring *u, int fd, int write, uint8_t *buf,
+			size_t len, unsigned int slot)
+{
+	unsigned int tail = atomic_load_explicit(u->sq_tail,
+						 memory_order_relaxed);
+	unsigned int idx = tail & u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (u->fixed) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED :
+				      IORING_OP_READ_FIXED;
+		sqe->buf_index = slot;
+	} else
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = -1;		/* current position, spidev has none */
+	sqe->user_data = slot;
+	u->sq_array[idx] = idx;
+	atomic_store_explicit(u->sq_tail, tail + 1, memory_order_release);
+}
+
+static int uring_enter(struct uring *u, unsigned int submit)
+{
+	int ret;
+
+	do
+		ret = syscall(__NR_io_uring_enter, u->fd, submit, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+	while (ret < 0 && errno == EINTR && !stop);
+	return ret;
+}
+
+static void uring_exit(struct uring *u)
+{
+	munmap(u->sqes, u->sqes_len);
+	if (u->cq_map != u->sq_map)
+		munmap(u->cq_map, u->cq_map_len);
+	munmap(u->sq_map, u->sq_map_len);
+	close(u->fd);
+}
+
+static void half_done(struct spi_dev *dev, uint8_t *buf, ssize_t ret,
+		      uint64_t lat)
+{
+	if (ret < 0)
+		pabort(half_duplex == 'w' ? "can't write to spi device" :
+					    "can't read from spi device");
+	if (ret != transfer_size) {
+		fprintf(stderr, "short %s: %zd of %d bytes\n",
+			half_duplex == 'w' ? "write" : "read", ret,
+			transfer_size);
+		exit(1);
+	}
+
+	hist_record(&dev->lat_total, lat);
+	hist_record(&dev->lat_interval, lat);
+	if (half_duplex == 'w') {
+		dev->write_count += ret;
+		if (verbose)
+			hex_dump(buf, ret, 32, "TX");
+		return;
+	}
+
+	dev->read_count += ret;
+	if (output_file)
+		sink_write(&out, buf, ret);
+	if (verbose)
+		hex_dump(buf, ret, 32, "RX");
+}
+
+static void half_sync(struct spi_dev *dev, struct pattern_gen *gen,
+		      uint8_t *buf, long long left, struct timespec *last_stat)
+{
+	uint64_t t0;
+	ssize_t ret;
+
+	while (left-- > 0 && !stop) {
+		if (pace_rate)
+			pace_wait(&dev->pace);
+		if (half_duplex == 'w')
+			pattern_fill(gen, buf, transfer_size);
+		t0 = now_ns();
+		if (half_duplex == 'w')
+			ret = write(dev->fd, buf, transfer_size);
+		else
+			ret = read(dev->fd, buf, transfer_size);
+		dev->ioctl_count++;
+		half_done(dev, buf, ret, now_ns() - t0);
+		rate_tick(dev, last_stat);
+	}
+}
+
+static void half_uring(struct spi_dev *dev, struct pattern_gen *gen,
+		       uint8_t **bufs, long long left,
+		       struct timespec *last_stat)
+{
+	unsigned int free_slots[uring_depth];
+	uint64_t queued_at[uring_depth];
+	unsigned int nfree, submit = 0, inflight = 0, head, slot;
+	struct io_uring_cqe *cqe;
+	struct uring u;
+
+	uring_init(&u, uring_depth);
+	uring_register(&u, bufs, uring_depth, transfer_size);
+	if (verbose)
+		printf("io_uring: depth %d, %s buffers\n", uring_depth,
+		       u.fixed ? "registered" : "unregistered");
+
+	for (nfree = 0; nfree < (unsigned int)uring_depth; nfree++)
+		free_slots[nfree] = nfree;
+
+	while ((left > 0 && !stop) || inflight) {
+		while (left > 0 && nfree && !stop) {
+			if (pace_rate)
+				pace_wait(&dev->pace);
+			slot = free_slots[--nfree];
+			if (half_duplex == 'w')
+				pattern_fill(gen, bufs[slot], transfer_size);
+			queued_at[slot] = now_ns();
+			uring_queue(&u, dev->fd, half_duplex == 'w',
+				    bufs[slot], transfer_size, slot);
+			submit++;
+			inflight++;
+			left--;
+			/* a paced queue goes out one transfer at a time */
+			if (pace_rate)
+				break;
+		}
+
+		if (uring_enter(&u, submit) < 0 && !stop)
+			pabort("can't submit to io_uring");
+		dev->ioctl_count++;
+		submit = 0;
+
+		head = atomic_load_explicit(u.cq_head, memory_order_relaxed);
+		while (head != atomic_load_explicit(u.cq_tail,
+						    memory_order_acquire)) {
+			cqe = &u.cqes[head & u.cq_mask];
+			slot = cqe->user_data;
+			half_done(dev, bufs[slot], cqe->res,
+				  now_ns() - queued_at[slot]);
+			free_slots[nfree++] = slot;
+			inflight--;
+			head++;
+		}
+		atomic_store_explicit(u.cq_head, head, memory_order_release);
+		rate_tick(dev, last_stat);
+	}
+
+	uring_exit(&u);
+}
+
+static void run_half_duplex(struct spi_dev *dev)
+{
+	struct timespec start, last_stat;
+	struct pattern_gen gen;
+	uint8_t **bufs;
+	int nbufs = uring_depth ? uring_depth : 1;
+	int i;
+
+	if (dev->fd < 0) {
+		fprintf(stderr, "--half needs the spidev transport\n");
+		exit(1);
+	}
+	if ((size_t)transfer_size > spidev_bufsiz) {
+		fprintf(stderr, "--half transfers are limited to bufsiz "
+			"(%zu bytes)\n", spidev_bufsiz);
+		exit(1);
+	}
+
+	bufs = calloc(nbufs, sizeof(*bufs));
+	if (!bufs)
+		pabort("can't allocate buffers");
+	for (i = 0; i < nbufs; i++)
+		bufs[i] = pool_alloc_buf(transfer_size);
+	pattern_init(&gen, pattern, seed);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last_stat = start;
+	if (pace_rate)
+		pace_start(&dev->pace);
+
+	if (uring_depth)
+		half_uring(dev, &gen, bufs, run_length(), &last_stat);
+	else
+		half_sync(dev, &gen, bufs[0], run_length(), &last_stat);
+	finish_run(dev, &start);
+
+	for (i = 0; i < nbufs; i++)
+		free(bufs[i]);
+	free(bufs);
+}
+
+/*
+ * Single producer, single consumer ring of pointers. head is only written
+ * by the producer and tail only by the consumer, so the acquire/release
+ * pair on each index is all the synchronisation needed.
+ */
+struct spsc_ring {
+	atomic_uint head;
+	char pad[64 - sizeof(atomic_uint)];
+	atomic_uint tail;
+	unsigned int mask;
+	void **items;
+};
+
+static void ring_init(struct spsc_ring *r, unsigned int min_size)
+{
+	unsigned int size = 1;
+
+	while (size < min_size)
+		size <<= 1;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	r->mask = size - 1;
+	r->items = calloc(size, sizeof(*r->items));
+	if (!r->items)
+		pabort("can't allocate ring");
+}
+
+static int ring_push(struct spsc_ring *r, void *item)
+{
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	if (head - tail > r->mask)
+		return 0;
+	r->items[head & r->mask] = item;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return 1;
+}
+
+static void *ring_pop(struct spsc_ring *r)
+{
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+	void *item;
+
+	if (head == tail)
+		return NULL;
+	item = r->items[tail & r->mask];
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return item;
+}
+
+/* spin briefly, then give the CPU away: stages may share a core */
+static void ring_wait(unsigned int *spins)
+{
+	if (++*spins > 64)
+		sched_yield();
+}
+
+static void ring_put(struct spsc_ring *r, void *item)
+{
+	unsigned int spins = 0;
+
+	while (!ring_push(r, item))
+		ring_wait(&spins);
+}
+
+static void *ring_get(struct spsc_ring *r)
+{
+	unsigned int spins = 0;
+	void *item;
+
+	while (!(item = ring_pop(r)))
+		ring_wait(&spins);
+	return item;
+}
+
+/*
+ * --pipeline: buffer slots circulate free -> generator -> transfer ->
+ * verifier -> free, so pattern generation, loopback compare and output
+ * for one slot overlap with the bus working on the next. A slot with no
+ * transfers in it is passed down the line to shut each stage down.
+ */
+struct pipe_slot {
+	uint8_t *tx;
+	uint8_t *rx;
+	int n;
+};
+
+struct pipe {
+	struct spi_dev *dev;
+	int len;
+	long long count;
+	struct spsc_ring free, filled, done;
+};
+
+static void pin_thread(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		fprintf(stderr, "can't pin thread to cpu %d\n", cpu);
+}
+
+static void *pipe_generate(void *arg)
+{
+	struct pipe *p = arg;
+	struct pattern_gen gen;
+	struct pipe_slot *slot;
+	long long left = p->count;
+
+	pin_thread(stage_cpu[0]);
+	pattern_init(&gen, pattern, seed);
+
+	do {
+		slot = ring_get(&p->free);
+		slot->n = stop ? 0 : left < batch ? left : batch;
+		pattern_fill(&gen, slot->tx, (size_t)p->len * slot->n);
+		left -= slot->n;
+		ring_put(&p->filled, slot);
+	} while (slot->n);
+
+	return NULL;
+}
+
+static void *pipe_transfer(void *arg)
+{
+	struct spi_ioc_transfer tr[MAX_BATCH];
+	struct pipe *p = arg;
+	struct pipe_slot *slot;
+	struct timespec start, last_stat;
+
+	pin_thread(stage_cpu[1]);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last_stat = start;
+	if (pace_rate)
+		pace_start(&p->dev->pace);
+
+	while ((slot = ring_get(&p->filled))->n) {
+		if (pace_rate)
+			pace_wait(&p->dev->pace);
+		setup_batch(p->dev, tr, slot->tx, slot->rx, p->len, slot->n);
+		spi_submit(p->dev, tr, slot->n);
+		p->dev->write_count += (size_t)p->len * slot->n;
+		p->dev->read_count += (size_t)p->len * slot->n;
+		ring_put(&p->done, slot);
+		rate_tick(p->dev, &last_stat);
+	}
+	ring_put(&p->done, slot);
+	finish_run(p->dev, &start);
+
+	return NULL;
+}
+
+static void *pipe_verify(void *arg)
+{
+	struct pipe *p = arg;
+	struct pipe_slot *slot;
+	size_t len;
+
+	pin_thread(stage_cpu[2]);
+
+	while ((slot = ring_get(&p->done))->n) {
+		len = (size_t)p->len * slot->n;
+		if (verbose) {
+			hex_dump(slot->tx, len, 32, "TX");
+			hex_dump(slot->rx, len, 32, "RX");
+		}
+		if (p->dev->mode & SPI_LOOP)
+			verify_buf(p->dev, slot->tx, slot->rx, len);
+		if (output_file)
+			sink_write(&out, slot->rx, len);
+		ring_put(&p->free, slot);
+	}
+
+	return NULL;
+}
+
+static void transfer_pipeline(struct spi_dev *dev)
+{
+	void *(*stage[3])(void *) = { pipe_generate, pipe_transfer,
+				      pipe_verify };
+	pthread_t thread[3];
+	struct pipe_slot *slots;
+	struct buf_pool *pools;
+	struct pipe p;
+	int i;
+
+	p.dev = dev;
+	p.len = transfer_size;
+	p.count = run_length();
+	ring_init(&p.free, pipeline_depth);
+	ring_init(&p.filled, pipeline_depth);
+	ring_init(&p.done, pipeline_depth);
+
+	slots = calloc(pipeline_depth, sizeof(*slots));
+	pools = calloc(pipeline_depth, sizeof(*pools));
+	if (!slots || !pools)
+		pabort("can't allocate pipeline");
+	for (i = 0; i < pipeline_depth; i++) {
+		pool_init(&pools[i], (size_t)transfer_size * batch);
+		slots[i].tx = pools[i].tx;
+		slots[i].rx = pools[i].rx;
+		ring_put(&p.free, &slots[i]);
+	}
+
+	for (i = 0; i < 3; i++)
+		if (pthread_create(&thread[i], NULL, stage[i], &p))
+			pabort("can't start pipeline thread");
+	for (i = 0; i < 3; i++)
+		pthread_join(thread[i], NULL);
+
+	for (i = 0; i < pipeline_depth; i++)
+		pool_free(&pools[i]);
+	free(pools);
+	free(slots);
+	free(p.free.items);
+	free(p.filled.items);
+	free(p.done.items);
+}
+
+/*
+ * --adc: continuous capture from an ADC clocking out big-endian samples.
+ * Every -S byte frame is one transfer, done in bytes whatever -b says,
+ * into a ring of --adc-ring frame slots. A consumer thread unpacks the
+ * slots into host order samples and streams them to --output: 12 bit
+ * samples are the low bits of 16 bit words, 12 and 16 bit samples
+ * become int16_t and 24 bit ones sign extended int32_t. When the
+ * consumer falls behind, capture goes on into a scratch frame and the
+ * frame is counted as dropped, as is every deadline --rate missed.
+ */
+struct adc_slot {
+	uint8_t *raw;
+	void *samples;
+};
+
+struct adc {
+	struct spi_dev *dev;
+	size_t frame;		/* bytes per frame */
+	size_t nsamples;	/* samples per frame */
+	size_t sample_size;	/* bytes per unpacked sample */
+	uint64_t frames;
+	uint64_t overruns;
+	struct adc_slot end;	/* sentinel that stops the consumer */
+	struct spsc_ring free, filled;
+};
+
+/*
+ * Plain loops over restrict pointers: the compiler turns these into
+ * vector shuffles and shifts on any target with a SIMD unit.
+ */
+static void adc_unpack12(const uint8_t *restrict in, int16_t *restrict out,
+			 size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = (in[2 * i] << 8 | in[2 * i + 1]) & 0x0fff;
+}
+
+static void adc_unpack16(const uint8_t *restrict in, int16_t *restrict out,
+			 size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = (int16_t)(in[2 * i] << 8 | in[2 * i + 1]);
+}
+
+static void adc_unpack24(const uint8_t *restrict in, int32_t *restrict out,
+			 size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = (int32_t)((uint32_t)in[3 * i] << 24 |
+				   (uint32_t)in[3 * i + 1] << 16 |
+				   (uint32_t)in[3 * i + 2] << 8) >> 8;
+}
+
+static void adc_unpack(const uint8_t *in, void *out, size_t n)
+{
+	switch (adc_bits) {
+	case 12:
+		adc_unpack12(in, out, n);
+		break;
+	case 16:
+		adc_unpack16(in, out, n);
+		break;
+	default:
+		adc_unpack24(in, out, n);
+		break;
+	}
+}
+
+static void adc_show_samples(const struct adc *a, const void *samples)
+{
+	size_t i, n = a->nsamples < 16 ? a->nsamples : 16;
+
+	printf("samples |");
+	for (i = 0; i < n; i++)
+		printf(" %d", a->sample_size == 2 ?
+		       ((const int16_t *)samples)[i] :
+		       ((const int32_t *)samples)[i]);
+	printf("%s\n", n < a->nsamples ? " ..." : "");
+}
+
+static void *adc_consume(void *arg)
+{
+	struct adc *a = arg;
+	struct adc_slot *slot;
+
+	pin_thread(stage_cpu[2]);
+
+	while ((slot = ring_get(&a->filled)) != &a->end) {
+		adc_unpack(slot->raw, slot->samples, a->nsamples);
+		if (output_file)
+			sink_write(&out, slot->samples,
+				   a->nsamples * a->sample_size);
+		if (verbose)
+			adc_show_samples(a, slot->samples);
+		ring_put(&a->free, slot);
+	}
+
+	return NULL;
+}
+
+static void adc_show(const struct spi_dev *dev, const struct adc *a)
+{
+	uint64_t samples = a->frames * a->nsamples;
+	uint64_t missed = pace_rate ? dev->pace.missed : 0;
+	double rate = dev->secs > 0 ? samples / dev->secs : 0.0;
+
+	if (json) {
+		printf("{\"type\":\"adc\",");
+		show_device(dev);
+		printf("\"bits\":%d,\"frames\":%llu,\"samples\":%llu,"
+		       "\"samples_per_sec\":%.0f,\"dropped\":%llu,"
+		       "\"overruns\":%llu,\"missed_deadlines\":%llu}\n",
+		       adc_bits, (unsigned long long)a->frames,
+		       (unsigned long long)samples, rate,
+		       (unsigned long long)(a->overruns + missed),
+		       (unsigned long long)a->overruns,
+		       (unsigned long long)missed);
+		return;
+	}
+
+	printf("adc: %d bit, %llu frames of %zu samples, %.0f samples/s\n",
+	       adc_bits, (unsigned long long)a->frames, a->nsamples, rate);
+	printf("adc: %llu dropped frames (%llu ring overruns, %llu missed "
+	       "deadlines)\n", (unsigned long long)(a->overruns + missed),
+	       (unsigned long long)a->overruns, (unsigned long long)missed);
+}
+
+static void run_adc(struct spi_dev *dev)
+{
+	struct spi_ioc_transfer tr;
+	struct timespec start, last_stat;
+	struct adc_slot *slots, scratch, *slot;
+	long long left = iterations ? iterations : LLONG_MAX;
+	size_t word = adc_bits > 16 ? 3 : 2;
+	pthread_t consumer;
+	struct adc a;
+	int i;
+
+	memset(&a, 0, sizeof(a));
+	a.dev = dev;
+	a.frame = transfer_size;
+	a.nsamples = a.frame / word;
+	a.sample_size = adc_bits > 16 ? 4 : 2;
+	if (!a.nsamples || a.frame % word) {
+		fprintf(stderr, "-S must hold whole %d bit samples\n",
+			adc_bits);
+		exit(1);
+	}
+
+	ring_init(&a.free, adc_ring);
+	ring_init(&a.filled, adc_ring + 1);
+	slots = calloc(adc_ring, sizeof(*slots));
+	if (!slots)
+		pabort("can't allocate adc ring");
+	for (i = 0; i < adc_ring; i++) {
+		slots[i].raw = pool_alloc_buf(a.frame);
+		slots[i].samples = pool_alloc_buf(a.nsamples * a.sample_size);
+		ring_put(&a.free, &slots[i]);
+	}
+	scratch.raw = pool_alloc_buf(a.frame);
+
+	if (pthread_create(&consumer, NULL, adc_consume, &a))
+		pabort("can't start adc consumer");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last_stat = start;
+	if (pace_rate)
+		pace_start(&dev->pace);
+
+	while (left-- > 0 && !stop) {
+		if (pace_rate)
+			pace_wait(&dev->pace);
+		slot = ring_pop(&a.free);
+		if (!slot) {
+			slot = &scratch;
+			a.overruns++;
+		}
+
+		setup_transfer(dev, &tr, NULL, slot->raw, a.frame);
+		tr.bits_per_word = 8;
+		spi_submit(dev, &tr, 1);
+		dev->read_count += a.frame;
+		a.frames++;
+
+		if (slot != &scratch)
+			ring_put(&a.filled, slot);
+		rate_tick(dev, &last_stat);
+	}
+	ring_put(&a.filled, &a.end);
+	pthread_join(consumer, NULL);
+
+	finish_run(dev, &start);
+	adc_show(dev, &a);
+
+	for (i = 0; i < adc_ring; i++) {
+		free(slots[i].raw);
+		free(slots[i].samples);
+	}
+	free(scratch.raw);
+	free(slots);
+	free(a.free.items);
+	free(a.filled.items);
+}
+
+/*
+ * --sd: SD/MMC card in SPI mode. The card is brought up at 400 kHz with
+ * CMD0, CMD8, ACMD41 and CMD58 (CMD16 for byte addressed cards), then
+ * -I blocks from --sd-lba are read with CMD17 one block per command and
+ * with CMD18/CMD12 --sd-multi blocks per command, checking the CRC16 of
+ * every data token. --sd-write first writes the same range with CMD24
+ * and CMD25 and makes the reads verify the data; it destroys whatever is
+ * stored there. Chip select stays asserted for the whole of a command,
+ * which may take several transfers, and is dropped after it. MISO bytes
+ * clocked in beyond what a step needed are kept for the next one, so a
+ * block usually costs one transfer.
+ */
+#define SD_INIT_HZ	400000
+#define SD_POLL		16	/* bytes clocked per poll for a response */
+#define SD_NCR		8	/* bytes a card may take to answer */
+
+struct sd_card {
+	struct spi_dev *dev;
+	uint32_t hz;
+	int block_addr;		/* SDHC/SDXC count addresses in blocks */
+	uint32_t ocr;
+	uint8_t pend[SD_POLL];	/* MISO clocked in ahead of time */
+	size_t pend_pos, pend_len;
+	uint8_t tx[SD_BLOCK + 4 + SD_POLL];
+	uint8_t rx[SD_BLOCK + 4 + SD_POLL];
+	uint64_t crc_errors;
+};
+
+static uint8_t sd_ones[SD_BLOCK + 4 + SD_POLL];
+
+static void sd_error(const char *what, int val)
+{
+	fprintf(stderr, "sd: %s (0x%02x)\n", what, val & 0xff);
+	exit(1);
+}
+
+/* one transfer, keeping the card selected afterwards */
+static void sd_xfer(struct sd_card *c, const uint8_t *tx, uint8_t *rx,
+		    size_t len)
+{
+	struct spi_ioc_transfer tr;
+
+	setup_transfer(c->dev, &tr, tx, rx, len);
+	tr.speed_hz = c->hz;
+	tr.bits_per_word = 8;
+	tr.delay_usecs = 0;
+	tr.cs_change = 1;
+	spi_submit(c->dev, &tr, 1);
+}
+
+/* deselect, with the eight clocks a card wants to finish up */
+static void sd_release(struct sd_card *c)
+{
+	struct spi_ioc_transfer tr;
+
+	setup_transfer(c->dev, &tr, sd_ones, NULL, 1);
+	tr.speed_hz = c->hz;
+	tr.bits_per_word = 8;
+	tr.delay_usecs = 0;
+	spi_submit(c->dev, &tr, 1);
+	c->pend_pos = c->pend_len = 0;
+}
+
+static void sd_pend(struct sd_card *c, const uint8_t *rx)
+{
+	memcpy(c->pend, rx, SD_POLL);
+	c->pend_pos = 0;
+	c->pend_len = SD_POLL;
+}
+
+static uint8_t sd_byte(struct sd_card *c)
+{
+	if (c->pend_pos == c->pend_len) {
+		sd_xfer(c, sd_ones, c->rx, SD_POLL);
+		sd_pend(c, c->rx);
+	}
+	return c->pend[c->pend_pos++];
+}
+
+/* the first byte that isn't 0xff, within @ms */
+static int sd_token(struct sd_card *c, int ms)
+{
+	uint64_t deadline = mono_ns() + ms * 1000000ULL;
+	uint8_t b;
+
+	while ((b = sd_byte(c)) == 0xff)
+		if (mono_ns() > deadline)
+			return -1;
+	return b;
+}
+
+static void sd_wait_ready(struct sd_card *c, int ms)
+{
+	uint64_t deadline = mono_ns() + ms * 1000000ULL;
+
+	while (sd_byte(c) != 0xff)
+		if (mono_ns() > deadline)
+			sd_error("card stays busy", 0);
+}
+
+/* @len bytes of MISO, clocking SD_POLL more to look ahead */
+static void sd_read(struct sd_card *c, uint8_t *buf, size_t len)
+{
+	size_t have = c->pend_len - c->pend_pos;
+
+	if (have > len)
+		have = len;
+	memcpy(buf, c->pend + c->pend_pos, have);
+	c->pend_pos += have;
+	len -= have;
+	if (!len)
+		return;
+
+	sd_xfer(c, sd_ones, c->rx, len + SD_POLL);
+	memcpy(buf + have, c->rx, len);
+	sd_pend(c, c->rx + len);
+}
+
+static int sd_cmd(struct sd_card *c, int cmd, uint32_t arg, uint8_t *resp,
+		  int nresp)
+{
+	uint8_t *frame = c->tx;
+	int r1 = 0xff, i;
+
+	frame[0] = 0x40 | cmd;
+	frame[1] = arg >> 24;
+	frame[2] = arg >> 16;
+	frame[3] = arg >> 8;
+	frame[4] = arg;
+	frame[5] = sd_crc7(frame, 5) << 1 | 1;
+	memset(frame + 6, 0xff, SD_POLL);
+
+	sd_xfer(c, frame, c->rx, 6 + SD_POLL);
+	sd_pend(c, c->rx + 6);
+
+	if (cmd == 12)
+		sd_byte(c);	/* stuff byte */
+	for (i = 0; i <= SD_NCR && (r1 & 0x80); i++)
+		r1 = sd_byte(c);
+	if (r1 & 0x80)
+		return -1;
+	for (i = 0; i < nresp; i++)
+		resp[i] = sd_byte(c);
+	return r1;
+}
+
+static void sd_init(struct sd_card *c, struct spi_dev *dev)
+{
+	uint64_t t0 = mono_ns(), deadline;
+	uint8_t resp[4];
+	int r1, v2, i;
+
+	memset(c, 0, sizeof(*c));
+	memset(sd_ones, 0xff, sizeof(sd_ones));
+	c->dev = dev;
+	c->hz = dev->speed < SD_INIT_HZ ? dev->speed : SD_INIT_HZ;
 
-	if (input_tx)
-		transfer_escaped_string(fd, input_tx);
-	else if (input_file)
-		transfer_file(fd, input_file);
-	else if (transfer_size) {
-		struct timespec last_stat;
+	/* at least 74 clocks before the first command */
+	sd_xfer(c, sd_ones, NULL, 10);
+	sd_release(c);
+
+	for (i = 0; (r1 = sd_cmd(c, 0, 0, NULL, 0)) != 0x01; i++) {
+		sd_release(c);
+		if (i == 10)
+			sd_error("no card, CMD0 failed", r1);
+	}
+	sd_release(c);
 
-		clock_gettime(CLOCK_MONOTONIC, &last_stat);
+	r1 = sd_cmd(c, 8, 0x1aa, resp, 4);
+	sd_release(c);
+	if (r1 < 0)
+		sd_error("CMD8 failed", r1);
+	v2 = !(r1 & 0x04);
+	if (v2 && ((resp[2] & 0x0f) != 0x01 || resp[3] != 0xaa))
+		sd_error("card doesn't take 3.3V, CMD8", resp[3]);
 
-		while (iterations-- > 0) {
-			struct timespec current;
+	deadline = mono_ns() + 1000000000ULL;
+	do {
+		r1 = sd_cmd(c, 55, 0, NULL, 0);
+		if (r1 >= 0 && !(r1 & 0xfe))
+			r1 = sd_cmd(c, 41, v2 ? 1U << 30 : 0, NULL, 0);
+		sd_release(c);
+		if (r1 & 0xfe)
+			sd_error("ACMD41 failed", r1);
+	} while (r1 && mono_ns() < deadline);
+	if (r1)
+		sd_error("card stays idle", r1);
 
-			transfer_buf(fd, transfer_size);
+	r1 = sd_cmd(c, 58, 0, resp, 4);
+	sd_release(c);
+	if (r1)
+		sd_error("CMD58 failed", r1);
+	c->ocr = (uint32_t)resp[0] << 24 | resp[1] << 16 | resp[2] << 8 |
+		 resp[3];
+	c->block_addr = v2 && (c->ocr & (1U << 30));
 
-			clock_gettime(CLOCK_MONOTONIC, &current);
-			if (current.tv_sec - last_stat.tv_sec > interval) {
-				show_transfer_rate();
-				last_stat = current;
-			}
+	if (!c->block_addr) {
+		r1 = sd_cmd(c, 16, SD_BLOCK, NULL, 0);
+		sd_release(c);
+		if (r1)
+			sd_error("CMD16 failed", r1);
+	}
+	c->hz = dev->speed;
+
+	printf("sd: %s card, OCR 0x%08x, %s addressed, ready in %.1f ms\n",
+	       v2 ? "v2" : "v1", c->ocr, c->block_addr ? "block" : "byte",
+	       (mono_ns() - t0) / 1e6);
+}
+
+static void sd_read_blocks(struct sd_card *c, uint32_t lba, uint8_t *buf,
+			   int n)
+{
+	uint32_t addr = c->block_addr ? lba : lba * SD_BLOCK;
+	uint8_t crc[2];
+	int r1, i;
+
+	r1 = sd_cmd(c, n > 1 ? 18 : 17, addr, NULL, 0);
+	if (r1)
+		sd_error(n > 1 ? "CMD18 failed" : "CMD17 failed", r1);
+
+	for (i = 0; i < n; i++, buf += SD_BLOCK) {
+		r1 = sd_token(c, 250);
+		if (r1 != 0xfe)
+			sd_error("bad read token", r1);
+		sd_read(c, buf, SD_BLOCK);
+		sd_read(c, crc, 2);
+		if (sd_crc16(buf, SD_BLOCK) != (crc[0] << 8 | crc[1]))
+			c->crc_errors++;
+	}
+
+	if (n > 1) {
+		r1 = sd_cmd(c, 12, 0, NULL, 0);
+		if (r1)
+			sd_error("CMD12 failed", r1);
+		sd_wait_ready(c, 250);
+	}
+	sd_release(c);
+}
+
+static void sd_write_blocks(struct sd_card *c, uint32_t lba,
+			    const uint8_t *buf, int n)
+{
+	uint32_t addr = c->block_addr ? lba : lba * SD_BLOCK;
+	uint16_t crc;
+	int r1, i;
+
+	r1 = sd_cmd(c, n > 1 ? 25 : 24, addr, NULL, 0);
+	if (r1)
+		sd_error(n > 1 ? "CMD25 failed" : "CMD24 failed", r1);
+
+	for (i = 0; i < n; i++, buf += SD_BLOCK) {
+		crc = sd_crc16(buf, SD_BLOCK);
+		c->tx[0] = 0xff;
+		c->tx[1] = n > 1 ? 0xfc : 0xfe;
+		memcpy(c->tx + 2, buf, SD_BLOCK);
+		c->tx[SD_BLOCK + 2] = crc >> 8;
+		c->tx[SD_BLOCK + 3] = crc;
+		memset(c->tx + SD_BLOCK + 4, 0xff, SD_POLL);
+		sd_xfer(c, c->tx, c->rx, SD_BLOCK + 4 + SD_POLL);
+		sd_pend(c, c->rx + SD_BLOCK + 4);
+
+		r1 = sd_token(c, 10);
+		if (r1 < 0 || (r1 & 0x1f) != 0x05)
+			sd_error("data rejected", r1);
+		sd_wait_ready(c, 500);
+	}
+
+	if (n > 1) {
+		c->tx[0] = 0xfd;
+		memset(c->tx + 1, 0xff, SD_POLL);
+		sd_xfer(c, c->tx, c->rx, 1 + SD_POLL);
+		sd_pend(c, c->rx + 1);
+		sd_byte(c);	/* stuff byte */
+		sd_wait_ready(c, 500);
+	}
+	sd_release(c);
+}
+
+enum {
+	SD_WRITE_SINGLE,
+	SD_WRITE_MULTI,
+	SD_READ_SINGLE,
+	SD_READ_MULTI,
+};
+
+static const char * const sd_op_names[] = {
+	[SD_WRITE_SINGLE] = "write_single",
+	[SD_WRITE_MULTI] = "write_multi",
+	[SD_READ_SINGLE] = "read_single",
+	[SD_READ_MULTI] = "read_multi",
+};
+
+static void sd_phase(struct sd_card *c, int op, uint8_t *buf,
+		     const uint8_t *expect, int blocks)
+{
+	struct spi_dev *dev = c->dev;
+	uint64_t t0, start, syscalls = dev->ioctl_count;
+	uint64_t crc_errors = c->crc_errors, mismatches = 0;
+	struct lat_hist h;
+	double secs;
+	int per = op == SD_WRITE_MULTI || op == SD_READ_MULTI ? sd_multi : 1;
+	int done, n, i;
+
+	hist_reset(&h);
+	start = mono_ns();
+	for (done = 0; done < blocks && !stop; done += n) {
+		n = blocks - done < per ? blocks - done : per;
+		t0 = mono_ns();
+		if (op == SD_WRITE_SINGLE || op == SD_WRITE_MULTI)
+			sd_write_blocks(c, sd_lba + done,
+					buf + (size_t)done * SD_BLOCK, n);
+		else
+			sd_read_blocks(c, sd_lba + done,
+				       buf + (size_t)done * SD_BLOCK, n);
+		hist_record(&h, mono_ns() - t0);
+	}
+	secs = (mono_ns() - start) / 1e9;
+	syscalls = dev->ioctl_count - syscalls;
+	crc_errors = c->crc_errors - crc_errors;
+
+	if (expect)
+		for (i = 0; i < done; i++)
+			if (memcmp(buf + (size_t)i * SD_BLOCK,
+				   expect + (size_t)i * SD_BLOCK, SD_BLOCK))
+				mismatches++;
+	if (op == SD_WRITE_SINGLE || op == SD_WRITE_MULTI)
+		dev->write_count += (size_t)done * SD_BLOCK;
+	else
+		dev->read_count += (size_t)done * SD_BLOCK;
+
+	if (json) {
+		printf("{\"type\":\"sd\",");
+		show_device(dev);
+		printf("\"op\":\"%s\",\"blocks\":%d,\"blocks_per_cmd\":%d,"
+		       "\"secs\":%.3f,\"bytes_per_sec\":%.0f,"
+		       "\"syscalls\":%llu,\"crc_errors\":%llu,"
+		       "\"mismatches\":%llu,", sd_op_names[op], done, per,
+		       secs, secs > 0 ? done * SD_BLOCK / secs : 0.0,
+		       (unsigned long long)syscalls,
+		       (unsigned long long)crc_errors,
+		       (unsigned long long)mismatches);
+		show_latency(&h, "latency_us");
+		printf("}\n");
+		return;
+	}
+
+	printf("sd: %s: %d blocks, %d per command, %.1fKB in %.3fs, "
+	       "%.0f B/s, %llu syscalls\n", sd_op_names[op], done, per,
+	       done * SD_BLOCK / 1024.0, secs,
+	       secs > 0 ? done * SD_BLOCK / secs : 0.0,
+	       (unsigned long long)syscalls);
+	if (crc_errors || mismatches)
+		printf("sd: %s: %llu CRC errors, %llu blocks differ\n",
+		       sd_op_names[op], (unsigned long long)crc_errors,
+		       (unsigned long long)mismatches);
+	show_latency(&h, "latency");
+}
+
+static void run_sd(struct spi_dev *dev)
+{
+	struct pattern_gen gen;
+	struct sd_card card;
+	int blocks = iterations ? iterations : 1024;
+	size_t size = (size_t)blocks * SD_BLOCK;
+	uint8_t *data = NULL, *buf;
+
+	sd_init(&card, dev);
+
+	buf = pool_alloc_buf(size);
+	if (sd_write) {
+		data = pool_alloc_buf(size);
+		pattern_init(&gen, pattern, seed);
+		pattern_fill(&gen, data, size);
+		sd_phase(&card, SD_WRITE_SINGLE, data, NULL, blocks);
+		pattern_fill(&gen, data, size);
+		sd_phase(&card, SD_WRITE_MULTI, data, NULL, blocks);
+	}
+	sd_phase(&card, SD_READ_SINGLE, buf, data, blocks);
+	sd_phase(&card, SD_READ_MULTI, buf, data, blocks);
+
+	free(data);
+	free(buf);
+}
+
+/*
+ * Settings after the device path override the command line ones for that
+ * device only: path[,speed=HZ][,bits=N][,mode=0..3][,cpu=N][,transport=T]
+ */
+static void dev_parse(struct spi_dev *dev, const char *spec)
+{
+	char *copy, *opt, *val, *cur;
+
+	copy = strdup(spec);
+	if (!copy)
+		pabort("can't parse device");
+
+	cur = copy;
+	dev->path = strsep(&cur, ",");
+	dev->ops = transport_find(transport_name);
+	dev->mode = mode;
+	dev->bits = bits;
+	dev->speed = speed;
+	dev->cpu = -1;
+
+	while ((opt = strsep(&cur, ","))) {
+		val = strchr(opt, '=');
+		if (!val) {
+			fprintf(stderr, "bad device setting %s\n", opt);
+			exit(1);
+		}
+		*val++ = 0;
+		if (!strcmp(opt, "speed"))
+			dev->speed = strtoul(val, NULL, 0);
+		else if (!strcmp(opt, "bits"))
+			dev->bits = strtoul(val, NULL, 0);
+		else if (!strcmp(opt, "mode"))
+			dev->mode = (dev->mode & ~SPI_MODE_3) |
+				    (strtoul(val, NULL, 0) & SPI_MODE_3);
+		else if (!strcmp(opt, "cpu"))
+			dev->cpu = strtol(val, NULL, 0);
+		else if (!strcmp(opt, "transport"))
+			dev->ops = transport_find(val);
+		else {
+			fprintf(stderr, "unknown device setting %s\n", opt);
+			exit(1);
+		}
+	}
+
+	hist_reset(&dev->lat_total);
+	hist_reset(&dev->lat_interval);
+}
+
+static void dev_configure(struct spi_dev *dev)
+{
+	const char *err = dev->ops->setup(dev);
+
+	if (err)
+		pabort(err);
+}
+
+static void dev_open(struct spi_dev *dev)
+{
+	if (dev->ops->open(dev) < 0)
+		pabort("can't open device");
+
+	dev_configure(dev);
+
+	if (num_devices > 1)
+		printf("%s: ", dev->path);
+	printf("spi mode: 0x%x\n", dev->mode);
+	if (num_devices > 1)
+		printf("%s: ", dev->path);
+	printf("bits per word: %d\n", dev->bits);
+	if (num_devices > 1)
+		printf("%s: ", dev->path);
+	printf("max speed: %d Hz (%d KHz)\n", dev->speed, dev->speed/1000);
+}
+
+static void run_device(struct spi_dev *dev)
+{
+	if (soak)
+		soak_start(dev);
+	if (pipeline)
+		transfer_pipeline(dev);
+	else
+		transfer_loop(dev);
+	if (soak)
+		soak_finish(dev);
+}
+
+static void *dev_worker(void *arg)
+{
+	struct spi_dev *dev = arg;
+
+	pin_thread(dev->cpu);
+	run_device(dev);
+
+	return NULL;
+}
+
+static void stop_handler(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/* merge every device into one and report it as the aggregate */
+static void show_aggregate(double secs)
+{
+	struct spi_dev sum = { .path = "all" };
+	unsigned int i;
+	int d;
+
+	hist_reset(&sum.lat_total);
+	for (d = 0; d < num_devices; d++) {
+		struct spi_dev *dev = &devices[d];
+
+		sum.write_count += dev->write_count;
+		sum.read_count += dev->read_count;
+		sum.ioctl_count += dev->ioctl_count;
+		for (i = 0; i < HIST_BUCKETS; i++)
+			sum.lat_total.count[i] += dev->lat_total.count[i];
+		sum.lat_total.n += dev->lat_total.n;
+		sum.lat_total.sum += dev->lat_total.sum;
+		sum.lat_total.sumsq += dev->lat_total.sumsq;
+		if (dev->lat_total.min < sum.lat_total.min)
+			sum.lat_total.min = dev->lat_total.min;
+		if (dev->lat_total.max > sum.lat_total.max)
+			sum.lat_total.max = dev->lat_total.max;
+	}
+	sum.secs = secs;
+	show_totals("aggregate", &sum);
+}
+
+/*
+ * With several devices every one of them runs the -S/-I loop on its own
+ * thread, all at once, so the per device numbers show how the devices
+ * share their controllers and the aggregate shows what the SoC delivers.
+ */
+static void run_devices(void)
+{
+	struct timespec start, current;
+	int d;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (d = 0; d < num_devices; d++)
+		if (pthread_create(&devices[d].thread, NULL, dev_worker,
+				   &devices[d]))
+			pabort("can't start device thread");
+	for (d = 0; d < num_devices; d++)
+		pthread_join(devices[d].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &current);
+
+	show_aggregate(elapsed_sec(&start, &current));
+}
+
+/*
+ * --sweep walks the full grid of speed, transfer size, bits per word and
+ * batch depth, -I transfers per point, and prints one CSV (or JSON) row
+ * per point. In loopback every point is verified, and the fastest point
+ * without a single bad byte is recommended at the end.
+ */
+#define SWEEP_MAX 32
+
+enum { SWEEP_SPEED, SWEEP_SIZE, SWEEP_BITS, SWEEP_BATCH, SWEEP_AXES };
+
+struct sweep_axis {
+	const char *name;
+	unsigned long val[SWEEP_MAX];
+	int n;
+};
+
+struct sweep_point {
+	unsigned long val[SWEEP_AXES];
+	double bytes_per_sec;
+	uint64_t bytes;
+	uint64_t errors;
+	int failed;
+};
+
+static void sweep_parse(struct sweep_axis *axis, char *spec)
+{
+	char *opt, *val;
+	int a;
+
+	while ((opt = strsep(&spec, ","))) {
+		val = strchr(opt, '=');
+		if (!val)
+			goto bad;
+		*val++ = 0;
+		for (a = 0; a < SWEEP_AXES; a++)
+			if (!strcmp(opt, axis[a].name))
+				break;
+		if (a == SWEEP_AXES)
+			goto bad;
+		for (axis[a].n = 0; val && axis[a].n < SWEEP_MAX; axis[a].n++)
+			axis[a].val[axis[a].n] = strtoul(strsep(&val, ":"),
+							 NULL, 0);
+		if (val)
+			goto bad;
+	}
+	return;
+bad:
+	fprintf(stderr, "bad --sweep grid, expected e.g. speed=1000:2000,"
+		"size=32:512:4096,bits=8,batch=1:8 (values separated by ':',"
+		" at most %d each)\n",
+		SWEEP_MAX);
+	exit(1);
+}
+
+static void sweep_run_point(struct spi_dev *dev, struct sweep_point *pt,
+			    struct buf_pool *pool, struct pattern_gen *gen)
+{
+	struct spi_ioc_transfer tr[MAX_BATCH];
+	struct timespec start, end;
+	int size = pt->val[SWEEP_SIZE];
+	int depth = pt->val[SWEEP_BATCH];
+	int left = iterations ? iterations : 1000;
+	size_t total, i;
+	int n;
+
+	dev->speed = pt->val[SWEEP_SPEED];
+	dev->bits = pt->val[SWEEP_BITS];
+	if (dev->ops->setup(dev)) {
+		pt->failed = 1;
+		return;
+	}
+	dev->ioctl_count = 0;
+	hist_reset(&dev->lat_total);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (left > 0) {
+		n = left < depth ? left : depth;
+		total = (size_t)size * n;
+
+		pattern_fill(gen, pool->tx, total);
+		setup_batch(dev, tr, pool->tx, pool->rx, size, n);
+		if (spi_submit_try(dev, tr, n) < 1) {
+			pt->failed = 1;
+			break;
+		}
+		pt->bytes += total;
+		if (dev->mode & SPI_LOOP)
+			for (i = 0; i < total; i++)
+				pt->errors += pool->tx[i] != pool->rx[i];
+		left -= n;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pt->bytes_per_sec = pt->bytes / elapsed_sec(&start, &end);
+}
+
+static void sweep_show_point(struct spi_dev *dev, struct sweep_point *pt)
+{
+	const struct lat_hist *h = &dev->lat_total;
+	double rate = pt->bytes ? (double)pt->errors / pt->bytes : 0;
+
+	if (json) {
+		printf("{\"type\":\"sweep\",\"speed_hz\":%lu,\"size\":%lu,"
+		       "\"bits\":%lu,\"batch\":%lu,\"ok\":%s,"
+		       "\"bytes_per_sec\":%.0f,\"errors\":%llu,"
+		       "\"error_rate\":%g,",
+		       pt->val[SWEEP_SPEED], pt->val[SWEEP_SIZE],
+		       pt->val[SWEEP_BITS], pt->val[SWEEP_BATCH],
+		       pt->failed ? "false" : "true", pt->bytes_per_sec,
+		       (unsigned long long)pt->errors, rate);
+		show_latency(h, "latency_us");
+		printf("}\n");
+	} else {
+		printf("%lu,%lu,%lu,%lu,%s,%.0f,%.3f,%.3f,%.3f,%.3f,%llu,%g\n",
+		       pt->val[SWEEP_SPEED], pt->val[SWEEP_SIZE],
+		       pt->val[SWEEP_BITS], pt->val[SWEEP_BATCH],
+		       pt->failed ? "fail" : "ok", pt->bytes_per_sec,
+		       h->n ? hist_percentile(h, 50) / 1e3 : 0,
+		       h->n ? hist_percentile(h, 99) / 1e3 : 0,
+		       h->n ? hist_percentile(h, 99.9) / 1e3 : 0,
+		       h->n ? h->max / 1e3 : 0,
+		       (unsigned long long)pt->errors, rate);
+	}
+	fflush(stdout);
+}
+
+static void run_sweep(struct spi_dev *dev)
+{
+	struct sweep_axis axis[SWEEP_AXES] = {
+		[SWEEP_SPEED] = { "speed", { dev->speed }, 1 },
+		[SWEEP_SIZE]  = { "size", { transfer_size ? transfer_size : 32 },
+				  1 },
+		[SWEEP_BITS]  = { "bits", { dev->bits }, 1 },
+		[SWEEP_BATCH] = { "batch", { batch }, 1 },
+	};
+	struct sweep_point pt, best = { .failed = 1 };
+	struct pattern_gen gen;
+	struct buf_pool pool;
+	unsigned long max_size = 0, max_batch = 0;
+	int idx[SWEEP_AXES] = { 0 };
+	int a, i;
+
+	sweep_parse(axis, sweep_spec);
+	for (i = 0; i < axis[SWEEP_SIZE].n; i++)
+		if (axis[SWEEP_SIZE].val[i] > max_size)
+			max_size = axis[SWEEP_SIZE].val[i];
+	for (i = 0; i < axis[SWEEP_BATCH].n; i++) {
+		if (!axis[SWEEP_BATCH].val[i] ||
+		    axis[SWEEP_BATCH].val[i] > MAX_BATCH) {
+			fprintf(stderr, "batch must be 1..%d\n",
+				(int)MAX_BATCH);
+			exit(1);
 		}
-		printf("total: tx %.1fKB, rx %.1fKB\n",
-		       _write_count/1024.0, _read_count/1024.0);
+		if (axis[SWEEP_BATCH].val[i] > max_batch)
+			max_batch = axis[SWEEP_BATCH].val[i];
+	}
+	if (!max_size)
+		pabort("sweep needs a transfer size");
+
+	pool_init(&pool, max_size * max_batch);
+	pattern_init(&gen, pattern, seed);
+
+	if (!json)
+		puts("speed_hz,size,bits,batch,status,bytes_per_sec,p50_us,"
+		     "p99_us,p99.9_us,max_us,errors,error_rate");
+
+	for (;;) {
+		memset(&pt, 0, sizeof(pt));
+		for (a = 0; a < SWEEP_AXES; a++)
+			pt.val[a] = axis[a].val[idx[a]];
+
+		sweep_run_point(dev, &pt, &pool, &gen);
+		sweep_show_point(dev, &pt);
+
+		if (!pt.failed && !pt.errors &&
+		    (best.failed || pt.bytes_per_sec > best.bytes_per_sec))
+			best = pt;
+
+		/* odometer over the axes, the last one turning fastest */
+		for (a = SWEEP_AXES - 1; a >= 0; a--) {
+			if (++idx[a] < axis[a].n)
+				break;
+			idx[a] = 0;
+		}
+		if (a < 0)
+			break;
+	}
+
+	if (best.failed) {
+		printf(json ? "{\"type\":\"recommended\",\"ok\":false}\n" :
+		       "recommended: none, every point failed or had errors\n");
+	} else if (json) {
+		printf("{\"type\":\"recommended\",\"ok\":true,"
+		       "\"speed_hz\":%lu,\"size\":%lu,\"bits\":%lu,"
+		       "\"batch\":%lu,\"bytes_per_sec\":%.0f,"
+		       "\"verified\":%s}\n",
+		       best.val[SWEEP_SPEED], best.val[SWEEP_SIZE],
+		       best.val[SWEEP_BITS], best.val[SWEEP_BATCH],
+		       best.bytes_per_sec,
+		       dev->mode & SPI_LOOP ? "true" : "false");
+	} else {
+		printf("recommended: -s %lu -S %lu -b %lu --batch %lu "
+		       "(%.0f B/s%s)\n",
+		       best.val[SWEEP_SPEED], best.val[SWEEP_SIZE],
+		       best.val[SWEEP_BITS], best.val[SWEEP_BATCH],
+		       best.bytes_per_sec,
+		       dev->mode & SPI_LOOP ? ", verified in loopback" :
+		       ", not verified without -l");
+	}
+
+	pool_free(&pool);
+}
+
+/*
+ * --rt: SCHED_FIFO, all current and future memory locked, optionally
+ * pinned to one cpu, and a chunk of stack touched so the transfer path
+ * never takes a page fault. Threads started later (pipeline stages,
+ * device workers) inherit the policy and the affinity.
+ *
+ * Scheduling latency is measured before and after switching, as the
+ * lateness of 1000 absolute 200us clock_nanosleep() wakeups, so the
+ * effect of the configuration shows before any transfer is made.
+ */
+#define RT_SAMPLES	1000
+#define RT_PERIOD_NS	200000
+#define RT_STACK	(256 * 1024)
+
+static void sched_latency(struct lat_hist *h)
+{
+	struct timespec next, now;
+	int64_t late;
+	int i;
+
+	hist_reset(h);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < RT_SAMPLES; i++) {
+		next.tv_nsec += RT_PERIOD_NS;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		late = (now.tv_sec - next.tv_sec) * 1000000000LL +
+		       now.tv_nsec - next.tv_nsec;
+		hist_record(h, late > 0 ? late : 0);
+	}
+}
+
+static void show_hist(const char *type, const char *label,
+		      const struct lat_hist *h)
+{
+	if (json) {
+		printf("{\"type\":\"%s\",\"mode\":\"%s\",", type, label);
+		show_latency(h, "latency_us");
+		printf("}\n");
+	} else {
+		char name[64];
+
+		snprintf(name, sizeof(name), "%s (%s)", type, label);
+		show_latency(h, name);
+	}
+}
+
+static void prefault_stack(void)
+{
+	volatile uint8_t stack[RT_STACK];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+static void rt_enter(void)
+{
+	struct sched_param param = { .sched_priority = rt_prio };
+	static struct lat_hist before, after;
+	int err;
+
+	sched_latency(&before);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		pabort("can't lock memory");
+	err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err) {
+		errno = err;
+		pabort("can't set SCHED_FIFO");
+	}
+	pin_thread(rt_cpu);
+	prefault_stack();
+
+	sched_latency(&after);
+
+	if (!json && rt_cpu < 0)
+		printf("rt: SCHED_FIFO priority %d, memory locked\n", rt_prio);
+	else if (!json)
+		printf("rt: SCHED_FIFO priority %d, cpu %d, memory locked\n",
+		       rt_prio, rt_cpu);
+	show_hist("sched latency", "default", &before);
+	show_hist("sched latency", "rt", &after);
+}
+
+static void dev_reset_stats(struct spi_dev *dev)
+{
+	dev->write_count = dev->read_count = dev->ioctl_count = 0;
+	dev->prev_write_count = dev->prev_read_count = 0;
+	dev->prev_ioctl_count = 0;
+	hist_reset(&dev->lat_total);
+	hist_reset(&dev->lat_interval);
+}
+
+/* the same -S run twice, first as configured and then under --rt */
+static void run_rt_compare(struct spi_dev *dev)
+{
+	static struct lat_hist normal;
+
+	run_device(dev);
+	normal = dev->lat_total;
+	dev_reset_stats(dev);
+
+	rt_enter();
+	run_device(dev);
+
+	show_hist("transfer latency", "default", &normal);
+	show_hist("transfer latency", "rt", &dev->lat_total);
+}
+
+/*
+ * The same -S run on the device's transport and then on another one,
+ * e.g. spidev against mmio on the same chip select.
+ */
+static void run_transport_compare(struct spi_dev *dev)
+{
+	const struct spi_transport *ops = transport_find(compare_transport);
+	const char *first_name = dev->ops->name;
+	static struct lat_hist first;
+
+	run_device(dev);
+	first = dev->lat_total;
+
+	dev->ops->close(dev);
+	dev->ops = ops;
+	dev_open(dev);
+	dev_reset_stats(dev);
+	run_device(dev);
+
+	show_hist("transfer latency", first_name, &first);
+	show_hist("transfer latency", ops->name, &dev->lat_total);
+}
+
+/*
+ * --cpu-cost: what the run cost in CPU, next to what it moved. Cycles,
+ * instructions and context switches come from perf_event_open() counters
+ * on the whole process, threads included; when perf_event_paranoid
+ * forbids counting the kernel they fall back to user space only, and
+ * without perf events at all to getrusage() CPU time. A transfer is one
+ * message handed to the driver, so "per transfer" is per syscall.
+ */
+enum {
+	COST_CYCLES,
+	COST_INSTRUCTIONS,
+	COST_CSW,
+	COST_COUNTERS,
+};
+
+struct cpu_cost {
+	int fd[COST_COUNTERS];
+	int user_only;
+	struct rusage ru;
+	uint64_t t0;
+};
+
+static int cost_open(uint32_t type, uint64_t config, int user_only)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.inherit = 1;
+	attr.exclude_kernel = user_only;
+	attr.exclude_hv = user_only;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void cost_start(struct cpu_cost *c)
+{
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[COST_COUNTERS] = {
+		[COST_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		[COST_INSTRUCTIONS] = { PERF_TYPE_HARDWARE,
+					PERF_COUNT_HW_INSTRUCTIONS },
+		[COST_CSW] = { PERF_TYPE_SOFTWARE,
+			       PERF_COUNT_SW_CONTEXT_SWITCHES },
+	};
+	int i;
+
+	c->user_only = 0;
+	for (i = 0; i < COST_COUNTERS; i++) {
+		c->fd[i] = cost_open(events[i].type, events[i].config,
+				     c->user_only);
+		if (c->fd[i] < 0 && (errno == EACCES || errno == EPERM) &&
+		    !c->user_only) {
+			/* perf_event_paranoid >= 2: user space only */
+			while (i > 0)
+				close(c->fd[--i]);
+			c->user_only = 1;
+			i = -1;
+		}
+	}
+
+	getrusage(RUSAGE_SELF, &c->ru);
+	c->t0 = mono_ns();
+}
+
+static uint64_t cost_read(struct cpu_cost *c, int i)
+{
+	uint64_t val;
+
+	if (c->fd[i] < 0 || read(c->fd[i], &val, sizeof(val)) != sizeof(val))
+		return 0;
+	return val;
+}
+
+static double tv_sec(const struct timeval *a, const struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+static void cost_finish(struct cpu_cost *c)
+{
+	uint64_t val[COST_COUNTERS], bytes = 0, transfers = 0;
+	double secs = (mono_ns() - c->t0) / 1e9;
+	double user, sys, cpu_ns;
+	struct rusage ru;
+	long csw;
+	int perf, d, i;
+
+	for (i = 0; i < COST_COUNTERS; i++)
+		val[i] = cost_read(c, i);
+	getrusage(RUSAGE_SELF, &ru);
+	user = tv_sec(&c->ru.ru_utime, &ru.ru_utime);
+	sys = tv_sec(&c->ru.ru_stime, &ru.ru_stime);
+	cpu_ns = (user + sys) * 1e9;
+	csw = (ru.ru_nvcsw - c->ru.ru_nvcsw) + (ru.ru_nivcsw - c->ru.ru_nivcsw);
+	perf = c->fd[COST_CYCLES] >= 0;
+	if (c->fd[COST_CSW] >= 0)
+		csw = val[COST_CSW];
+	for (i = 0; i < COST_COUNTERS; i++)
+		if (c->fd[i] >= 0)
+			close(c->fd[i]);
+
+	for (d = 0; d < num_devices; d++) {
+		bytes += devices[d].write_count > devices[d].read_count ?
+			 devices[d].write_count : devices[d].read_count;
+		transfers += devices[d].ioctl_count;
+	}
+
+	if (json) {
+		printf("{\"type\":\"cpu\",\"source\":\"%s\",\"secs\":%.3f,"
+		       "\"user_secs\":%.3f,\"sys_secs\":%.3f,"
+		       "\"context_switches\":%ld,",
+		       perf ? c->user_only ? "perf_user" : "perf" : "rusage",
+		       secs, user, sys, csw);
+		if (perf)
+			printf("\"cycles\":%llu,\"instructions\":%llu,"
+			       "\"cycles_per_byte\":%.2f,"
+			       "\"cycles_per_transfer\":%.0f,",
+			       (unsigned long long)val[COST_CYCLES],
+			       (unsigned long long)val[COST_INSTRUCTIONS],
+			       bytes ? (double)val[COST_CYCLES] / bytes : 0.0,
+			       transfers ?
+			       (double)val[COST_CYCLES] / transfers : 0.0);
+		printf("\"cpu_ns_per_byte\":%.2f,\"cpu_ns_per_transfer\":%.0f}\n",
+		       bytes ? cpu_ns / bytes : 0.0,
+		       transfers ? cpu_ns / transfers : 0.0);
+		return;
+	}
+
+	printf("cpu: user %.3fs, sys %.3fs (%.0f%% of %.3fs), %ld context "
+	       "switches\n", user, sys, secs > 0 ? 100 * (user + sys) / secs : 0,
+	       secs, csw);
+	if (perf)
+		printf("cpu: %llu cycles, %llu instructions (%.2f IPC)%s, "
+		       "%.2f cycles/byte, %.0f cycles/transfer\n",
+		       (unsigned long long)val[COST_CYCLES],
+		       (unsigned long long)val[COST_INSTRUCTIONS],
+		       val[COST_CYCLES] ?
+		       (double)val[COST_INSTRUCTIONS] / val[COST_CYCLES] : 0.0,
+		       c->user_only ? " in user space" : "",
+		       bytes ? (double)val[COST_CYCLES] / bytes : 0.0,
+		       transfers ? (double)val[COST_CYCLES] / transfers : 0.0);
+	else
+		printf("cpu: %.2f ns/byte, %.0f ns/transfer of CPU time\n",
+		       bytes ? cpu_ns / bytes : 0.0,
+		       transfers ? cpu_ns / transfers : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct spi_dev *dev = &devices[0];
+	struct cpu_cost cost;
+	int ret = 0;
+	int d;
+
+	parse_opts(argc, argv);
+	read_bufsiz();
+
+	if (!num_devices)
+		device_spec[num_devices++] = "/dev/spidev1.1";
+	if (model_file)
+		model_load(model_file);
+	for (d = 0; d < num_devices; d++) {
+		dev_parse(&devices[d], device_spec[d]);
+		dev_open(&devices[d]);
+	}
+
+	if (input_tx && input_file)
+		pabort("only one of -p and --input may be selected");
+	if (script_file && (input_tx || input_file || num_devices > 1)) {
+		fprintf(stderr, "--script excludes -p, --input and several "
+			"devices\n");
+		exit(1);
+	}
+
+	if (num_devices > 1 && (!transfer_size || output_file || sweep_spec)) {
+		fprintf(stderr, "several devices need -S and no --output\n");
+		exit(1);
+	}
+
+	if (soak && !(mode & SPI_LOOP)) {
+		fprintf(stderr, "--soak needs loopback (-l)\n");
+		exit(1);
+	}
+	if (soak) {
+		signal(SIGINT, stop_handler);
+		signal(SIGTERM, stop_handler);
+	}
+
+	if (rt_compare && (num_devices > 1 || !transfer_size || sweep_spec)) {
+		fprintf(stderr, "--rt-compare needs -S and a single device\n");
+		exit(1);
+	}
+	if (compare_transport && (num_devices > 1 || !transfer_size ||
+				  sweep_spec || rt_compare || trace_file)) {
+		fprintf(stderr, "--compare-transport needs -S, a single device "
+			"and no --trace\n");
+		exit(1);
+	}
+	if (rt_prio && !rt_compare)
+		rt_enter();
+
+	if ((half_duplex || uring_depth) &&
+	    (!half_duplex || !transfer_size || num_devices > 1 || soak ||
+	     pipeline || sweep_spec || rt_compare)) {
+		fprintf(stderr, "--half needs -S and a single device; --uring "
+			"needs --half\n");
+		exit(1);
+	}
+
+	if (adc_bits && (!transfer_size || num_devices > 1 || soak ||
+			 pipeline || sweep_spec || rt_compare || half_duplex ||
+			 script_file)) {
+		fprintf(stderr, "--adc needs -S and a single device\n");
+		exit(1);
+	}
+	if ((sd_mode || sd_write) &&
+	    (!sd_mode || num_devices > 1 || soak || pipeline || sweep_spec ||
+	     rt_compare || half_duplex || script_file || adc_bits)) {
+		fprintf(stderr, "--sd needs a single device; --sd-write needs "
+			"--sd\n");
+		exit(1);
+	}
+
+	if (adc_bits && !iterations) {
+		signal(SIGINT, stop_handler);
+		signal(SIGTERM, stop_handler);
+	}
+
+	if (output_file)
+		sink_open(&out, output_file);
+	if (trace_file)
+		trace_open(trace_file);
+	if (cpu_cost)
+		cost_start(&cost);
+
+	if (input_tx)
+		transfer_escaped_string(dev, input_tx);
+	else if (input_file && chunk_size)
+		transfer_file_stream(dev, input_file);
+	else if (input_file)
+		transfer_file(dev, input_file);
+	else if (script_file)
+		run_script(dev);
+	else if (half_duplex)
+		run_half_duplex(dev);
+	else if (adc_bits)
+		run_adc(dev);
+	else if (sd_mode)
+		run_sd(dev);
+	else if (sweep_spec)
+		run_sweep(dev);
+	else if (transfer_size) {
+		printf("pattern: %s, seed 0x%llx\n", pattern_names[pattern],
+		       (unsigned long long)seed);
+		if (num_devices > 1)
+			run_devices();
+		else if (rt_compare)
+			run_rt_compare(dev);
+		else if (compare_transport)
+			run_transport_compare(dev);
+		else
+			run_device(dev);
 	} else
-		transfer(fd, default_tx, default_rx, sizeof(default_tx));
+		transfer(dev, default_tx, default_rx, sizeof(default_tx));
 
-	close(fd);
+	if (output_file)
+		sink_close(&out);
+	if (cpu_cost)
+		cost_finish(&cost);
+	if (trace_file)
+		trace_close();
+
+	for (d = 0; d < num_devices; d++)
+		devices[d].ops->close(&devices[d]);
 
 	return ret;
 }
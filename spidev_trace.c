@@ -0,0 +1,304 @@
+/*
+ * Offline viewer for spidev_test --trace files
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ * Prints the traced messages as a timeline in time order, optionally with
+ * hex dumps of their sampled payload, and a per device summary.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "spidev_trace.h"
+
+/* records sit at any offset in the file, so each is copied out aligned */
+struct msg {
+	struct spi_trace_rec rec;
+	const uint8_t *data;
+};
+
+struct dev_summary {
+	uint64_t messages;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t busy_ns;
+	uint32_t min_ns;
+	uint32_t max_ns;
+	uint64_t first_ns;
+	uint64_t end_ns;
+};
+
+static int hex;
+static int summary_only;
+static int only_dev = -1;
+
+static void pabort(const char *s)
+{
+	perror(s);
+	abort();
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-xsd] FILE\n", prog);
+	puts("  -x --hex      hex dump the sampled TX and RX of every message\n"
+	     "  -s --summary  only print the per device summary\n"
+	     "  -d --device N only show messages of device N");
+	exit(1);
+}
+
+static void parse_opts(int argc, char *argv[])
+{
+	while (1) {
+		static const struct option lopts[] = {
+			{ "hex",     0, 0, 'x' },
+			{ "summary", 0, 0, 's' },
+			{ "device",  1, 0, 'd' },
+			{ NULL, 0, 0, 0 },
+		};
+		int c;
+
+		c = getopt_long(argc, argv, "xsd:", lopts, NULL);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'x':
+			hex = 1;
+			break;
+		case 's':
+			summary_only = 1;
+			break;
+		case 'd':
+			only_dev = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+			break;
+		}
+	}
+	if (optind != argc - 1)
+		print_usage(argv[0]);
+}
+
+/* same layout as spidev_test's -v dumps */
+static void hex_dump(const void *src, size_t length, size_t line_size,
+		     char *prefix)
+{
+	int i = 0;
+	const unsigned char *address = src;
+	const unsigned char *line = address;
+	unsigned char c;
+
+	printf("%s | ", prefix);
+	while (length-- > 0) {
+		printf("%02X ", *address++);
+		if (!(++i % line_size) || (length == 0 && i % line_size)) {
+			if (length == 0) {
+				while (i++ % line_size)
+					printf("__ ");
+			}
+			printf(" | ");  /* right close */
+			while (line < address) {
+				c = *line++;
+				printf("%c", (c < 33 || c == 255) ? 0x2E : c);
+			}
+			printf("\n");
+			if (length > 0)
+				printf("%s | ", prefix);
+		}
+	}
+}
+
+static uint8_t *read_file(const char *filename, size_t *size)
+{
+	size_t alloc = 1 << 20, len = 0, n;
+	uint8_t *buf = NULL;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f)
+		pabort("can't open trace file");
+
+	do {
+		if (len == alloc || !buf) {
+			alloc *= 2;
+			buf = realloc(buf, alloc);
+			if (!buf)
+				pabort("can't allocate trace buffer");
+		}
+		n = fread(buf + len, 1, alloc - len, f);
+		len += n;
+	} while (n);
+	if (ferror(f))
+		pabort("can't read trace file");
+	fclose(f);
+
+	*size = len;
+	return buf;
+}
+
+/* records are written device by device, show them in time order */
+static int msg_cmp(const void *a, const void *b)
+{
+	const struct msg *x = a, *y = b;
+
+	if (x->rec.t_ns != y->rec.t_ns)
+		return x->rec.t_ns < y->rec.t_ns ? -1 : 1;
+	return x->rec.dev - y->rec.dev;
+}
+
+static void show_msg(const struct msg *m, uint64_t gap_ns, int first)
+{
+	const struct spi_trace_rec *r = &m->rec;
+	char gap[16] = "-";
+
+	if (!first)
+		snprintf(gap, sizeof(gap), "%.3f", gap_ns / 1e3);
+	printf("%14.3f %10.3f %10s %3u %4u %8u %9u %4u %6d%s%s\n",
+	       r->t_ns / 1e3, r->dur_ns / 1e3, gap, r->dev, r->ntr, r->len,
+	       r->speed_hz, r->bits, r->ret,
+	       r->flags & SPI_TRACE_CS_CHANGE ? " cs" : "",
+	       r->flags & SPI_TRACE_ERROR ? " error" : "");
+
+	if (hex && r->sample) {
+		hex_dump(m->data, r->sample, 32, "TX");
+		hex_dump(m->data + r->sample, r->sample, 32, "RX");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const struct spi_trace_hdr *hdr;
+	struct dev_summary *sum;
+	const char **paths;
+	struct msg *msgs = NULL;
+	size_t size, off, nmsgs = 0, alloc = 0, i;
+	uint64_t end;
+	uint8_t *buf;
+	uint32_t d;
+
+	parse_opts(argc, argv);
+	buf = read_file(argv[optind], &size);
+
+	hdr = (const struct spi_trace_hdr *)buf;
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, SPI_TRACE_MAGIC, sizeof(hdr->magic))) {
+		fprintf(stderr, "%s: not a spidev_test trace\n", argv[optind]);
+		return 1;
+	}
+	if (hdr->byte_order != SPI_TRACE_BYTE_ORDER ||
+	    hdr->version != SPI_TRACE_VERSION) {
+		fprintf(stderr, "%s: trace version %u from a machine of "
+			"other byte order or version\n", argv[optind],
+			hdr->version);
+		return 1;
+	}
+
+	paths = calloc(hdr->ndev, sizeof(*paths));
+	sum = calloc(hdr->ndev, sizeof(*sum));
+	if (!paths || !sum)
+		pabort("can't allocate devices");
+	off = sizeof(*hdr);
+	for (d = 0; d < hdr->ndev; d++) {
+		paths[d] = (const char *)buf + off;
+		off += strnlen(paths[d], size - off) + 1;
+		if (off > size) {
+			fprintf(stderr, "%s: truncated header\n", argv[optind]);
+			return 1;
+		}
+	}
+
+	while (off + sizeof(struct spi_trace_rec) <= size) {
+		struct spi_trace_rec rec, *r = &rec;
+
+		memcpy(r, buf + off, sizeof(*r));
+		if (off + sizeof(*r) + 2 * r->sample > size ||
+		    r->dev >= hdr->ndev)
+			break;
+		if (nmsgs == alloc) {
+			alloc = alloc ? 2 * alloc : 4096;
+			msgs = realloc(msgs, alloc * sizeof(*msgs));
+			if (!msgs)
+				pabort("can't allocate messages");
+		}
+		msgs[nmsgs].rec = rec;
+		msgs[nmsgs].data = buf + off + sizeof(*r);
+		nmsgs++;
+		off += sizeof(*r) + 2 * r->sample;
+	}
+	if (off != size)
+		fprintf(stderr, "%s: %zu trailing bytes ignored\n",
+			argv[optind], size - off);
+
+	qsort(msgs, nmsgs, sizeof(*msgs), msg_cmp);
+
+	if (!summary_only)
+		printf("%14s %10s %10s %3s %4s %8s %9s %4s %6s\n",
+		       "time(us)", "dur(us)", "gap(us)", "dev", "xfer", "len",
+		       "speed", "bits", "ret");
+
+	for (i = 0; i < nmsgs; i++) {
+		const struct spi_trace_rec *r = &msgs[i].rec;
+		struct dev_summary *s = &sum[r->dev];
+
+		if (only_dev >= 0 && r->dev != only_dev)
+			continue;
+		end = r->t_ns + r->dur_ns;
+		if (!summary_only)
+			show_msg(&msgs[i], r->t_ns > s->end_ns ?
+				 r->t_ns - s->end_ns : 0, !s->messages);
+
+		if (!s->messages) {
+			s->first_ns = r->t_ns;
+			s->min_ns = r->dur_ns;
+		}
+		s->messages++;
+		s->bytes += r->len;
+		s->errors += !!(r->flags & SPI_TRACE_ERROR);
+		s->busy_ns += r->dur_ns;
+		if (r->dur_ns < s->min_ns)
+			s->min_ns = r->dur_ns;
+		if (r->dur_ns > s->max_ns)
+			s->max_ns = r->dur_ns;
+		if (end > s->end_ns)
+			s->end_ns = end;
+	}
+
+	printf("\n%llu messages", (unsigned long long)nmsgs);
+	if (hdr->records || hdr->dropped)
+		printf(", %llu dropped while tracing",
+		       (unsigned long long)hdr->dropped);
+	printf("\n");
+	for (d = 0; d < hdr->ndev; d++) {
+		struct dev_summary *s = &sum[d];
+		double span = (s->end_ns - s->first_ns) / 1e9;
+
+		if (!s->messages)
+			continue;
+		printf("%u %s: %llu messages, %llu bytes, %llu errors, "
+		       "%.0f B/s\n", d, paths[d],
+		       (unsigned long long)s->messages,
+		       (unsigned long long)s->bytes,
+		       (unsigned long long)s->errors,
+		       span > 0 ? s->bytes / span : 0.0);
+		printf("%u %s: duration min %.3fus, mean %.3fus, max %.3fus, "
+		       "busy %.1f%% of %.3fs\n", d, paths[d],
+		       s->min_ns / 1e3, s->busy_ns / 1e3 / s->messages,
+		       s->max_ns / 1e3,
+		       span > 0 ? 100 * s->busy_ns / 1e9 / span : 0.0, span);
+	}
+
+	free(sum);
+	free(paths);
+	free(msgs);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Binary trace format written by spidev_test --trace and read by
+ * spidev_trace.
+ *
+ * A trace is a struct spi_trace_hdr, the ndev device paths each ending in
+ * a NUL, then records to the end of the file. A record is a struct
+ * spi_trace_rec followed by its sample TX bytes and sample RX bytes, the
+ * start of the message's payload. Fields are in the byte order of the
+ * machine that wrote the trace; byte_order reads SPI_TRACE_BYTE_ORDER
+ * when it matches the reader's.
+ */
+#ifndef SPIDEV_TRACE_H
+#define SPIDEV_TRACE_H
+
+#include <stdint.h>
+
+#define SPI_TRACE_MAGIC		"SPITRACE"
+#define SPI_TRACE_VERSION	1
+#define SPI_TRACE_BYTE_ORDER	0x01020304
+#define SPI_TRACE_SAMPLE_MAX	64
+
+struct spi_trace_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t records;	/* 0 if the writer couldn't seek back */
+	uint64_t dropped;	/* records lost to a full ring */
+	uint32_t ndev;
+	uint32_t sample;	/* largest per record sample */
+};
+
+/* flags */
+#define SPI_TRACE_CS_CHANGE	0x01	/* chip stays selected afterwards */
+#define SPI_TRACE_ERROR		0x02	/* ret is -errno */
+
+struct spi_trace_rec {
+	uint64_t t_ns;		/* start, since the trace began */
+	uint32_t dur_ns;
+	uint32_t len;		/* bytes in all transfers of the message */
+	int32_t ret;
+	uint32_t speed_hz;	/* of the first transfer */
+	uint16_t dev;
+	uint8_t ntr;		/* transfers, saturating at 255 */
+	uint8_t bits;
+	uint8_t flags;
+	uint8_t sample;		/* TX and RX bytes that follow */
+	uint16_t pad;
+};
+
+#endif /* SPIDEV_TRACE_H */